@@ -0,0 +1,252 @@
+#include "asm.h"
+#include "parse.h"
+#include "vreg.h"
+#include "superopt.h"
+#include "diag.h"
+#include "sprite.h"
+#include "stats.h"
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+void add_source_line(struct source* src, const char* text, int linenumber){
+    if(src->count == src->cap){
+        src->cap = src->cap ? src->cap * 2 : 64;
+        src->lines = realloc(src->lines, src->cap * sizeof(struct src_line));
+        if(src->lines == NULL){
+            printf("Error: out of memory\n");
+            exit(1);
+        }
+    }
+    char* copy = malloc(strlen(text) + 1);
+    if(copy == NULL){
+        printf("Error: out of memory\n");
+        exit(1);
+    }
+    strcpy(copy, text);
+    src->lines[src->count].text = copy;
+    src->lines[src->count].linenumber = linenumber;
+    src->count++;
+}
+
+void free_source(struct source* src){
+    for(int i = 0; i < src->count; i++)
+        free(src->lines[i].text);
+    free(src->lines);
+    memset(src, 0, sizeof(*src));
+}
+
+#ifndef NO_STATS
+static int line_kind(const char* line, const char* comment){
+    // for --stats: code, blank, or only a comment
+    for(const char* p = line; *p != '\0' && p != comment; p++)
+        if(!isspace((unsigned char)*p)) return STATS_LINE_CODE;
+    return comment != NULL ? STATS_LINE_COMMENT : STATS_LINE_BLANK;
+}
+#endif
+
+int read_source(FILE* fp, struct source* src){
+    char line[1024]; // more that enough for one line
+    int linenumber = 1;
+    char *comment_start = NULL;
+
+    STATS_START(read);
+    memset(src, 0, sizeof(*src));
+    while(fgets(line, sizeof(line), fp) != NULL){
+        STATS_LINE(line_kind(line, strchr(line, ';')), strlen(line));
+        // find comments
+        comment_start = strchr(line, ';'); //
+        if (comment_start != NULL) {
+            *comment_start = '\0'; // turn ';' into \0, so it's the end of C-string now
+        }
+        add_source_line(src, line, linenumber);
+        linenumber++;
+    }
+    STATS_STOP(STATS_READ, read);
+    return 0;
+}
+
+char* split_label(char* line, char** label){
+    // 'name:' at the start of a line is a label. The name is cut out in place
+    // into *label (NULL if there is none), returns the rest of the line.
+    char* start = line;
+    *label = NULL;
+    while(isspace((unsigned char)*start)) start++;
+
+    char* colon = strchr(start, ':');
+    if(colon == NULL) return line;
+
+    *colon = '\0';
+    if(!is_symbol_name(start)){
+        *colon = ':';
+        return line;
+    }
+    *label = start;
+    return colon + 1;
+}
+
+int report_parse_error(int opcode, int linenumber, int column, const char* code){
+    // prints the error, returns exit status for it or 0 if opcode is fine
+    switch(opcode){
+        case ERR_UNKNOWN_MNEMONIC:
+            diag_error(DIAG_UNKNOWN_MNEMONIC, linenumber, column, "unknown mnemonic on line %d '%s'", linenumber, code);
+            return 1;
+        case ERR_LARGE_DIGIT:
+            diag_error(DIAG_LARGE_DIGIT, linenumber, column, "too large digit on line %d '%s'", linenumber, code);
+            return 2;
+        case ERR_MISSING_OPERAND:
+            diag_error(DIAG_MISSING_OPERAND, linenumber, column, "missing operand on line %d '%s'", linenumber, code);
+            return 3;
+        case REG_ERR_UNKNOWN:
+            diag_error(DIAG_UNKNOWN_REGISTER, linenumber, column, "unknown register number on line %d '%s'", linenumber, code);
+            return 4;
+        case REG_ERR_MISSING:
+            diag_error(DIAG_MISSING_REGISTER, linenumber, column, "missing register number on line %d '%s'", linenumber, code);
+            return 5;
+        case ERR_INVALID_OPERAND:
+            diag_error(DIAG_INVALID_OPERAND, linenumber, column, "invalid operand on line %d '%s'", linenumber, code);
+            return 6;
+    }
+    return 0;
+}
+
+int is_directive(const char* code, const char* name){
+    // code starts with the directive name as a whole word
+    while(isspace((unsigned char)*code)) code++;
+    size_t length = strlen(name);
+    return strncmp(code, name, length) == 0 && (code[length] == '\0' || isspace((unsigned char)code[length]));
+}
+
+static int assemble_incsprite(struct object* obj, char* line, char* code, const char* label, int linenumber){
+    // INCSPRITE file[, threshold[, rows]]
+    char* tokens[5] = {NULL};
+    lex_tokens(code, tokens, 4);
+    struct operand threshold, rows;
+    lex_operand(tokens[2], &threshold);
+    lex_operand(tokens[3], &rows);
+
+    int error = 0;
+    char* at = tokens[0];
+    if(tokens[1] == NULL){
+        error = ERR_MISSING_OPERAND;
+    } else if(threshold.kind != OPERAND_NONE && (threshold.kind != OPERAND_NUMBER || threshold.range > RANGE_BYTE)){
+        error = ERR_LARGE_DIGIT;
+        at = threshold.text;
+    } else if(rows.kind != OPERAND_NONE && (rows.kind != OPERAND_NUMBER || rows.value == 0 || rows.value > SPRITE_BIG)){
+        error = ERR_LARGE_DIGIT;
+        at = rows.text;
+    } else if(rows.value == SPRITE_BIG && parse_get_target() == TARGET_CHIP8){
+        // same code as --sprites, the exit status stays the one of an invalid operand
+        diag_error(DIAG_SPRITE_TARGET, linenumber, rows.text - line + 1,
+                   "16x16 sprites need --target schip or xochip on line %d", linenumber);
+        return 6;
+    }
+    if(error != 0)
+        return report_parse_error(error, linenumber, at - line + 1, code);
+
+    return sprite_include(obj, tokens[1], label,
+                          threshold.kind == OPERAND_NONE ? SPRITE_THRESHOLD : threshold.value,
+                          rows.value, linenumber);
+}
+
+int assemble_source(struct source* src, struct object* obj){
+    // A bad line doesn't stop assembling, so one run reports every error.
+    // Returns the exit status of the first one.
+    char line[1024];
+    int is_empty;
+    int result = 0;
+    STATS_START(assemble);
+    STATS_ENCODING(1);
+
+    for(int n = 0; n < src->count; n++){
+        int linenumber = src->lines[n].linenumber;
+        src->lines[n].offset = obj->size;
+        strncpy(line, src->lines[n].text, sizeof(line) - 1);
+        line[sizeof(line) - 1] = '\0';
+
+        char* label;
+        char* code = split_label(line, &label);
+        if(label != NULL && obj_define_symbol(obj, label, obj->size) == ERR_DUPLICATE_SYMBOL){
+            diag_error(DIAG_DUPLICATE_LABEL, linenumber, label - line + 1, "label defined twice on line %d '%s'", linenumber, line);
+            if(result == 0) result = 7;
+        }
+
+        is_empty = 1;
+        for (int i = 0; code[i] != '\0'; i++) {
+            if (!isspace((unsigned char)code[i])) {
+                is_empty = 0;
+                break;
+            }
+        }
+        if (is_empty) {
+            continue;
+        }
+
+        if(is_directive(code, "INCSPRITE")){
+            int status = assemble_incsprite(obj, line, code, label, linenumber);
+            if(status != 0 && result == 0) result = status;
+            continue;
+        }
+
+        int opcode = parse_for_opcode(code);
+
+        int status = report_parse_error(opcode, linenumber, code - line + parse_error_column + 1, code);
+        if(status != 0){
+            // keep the space of the instruction, so later errors are not about moved labels
+            obj_emit_opcode(obj, 0);
+            if(result == 0) result = status;
+            continue;
+        }
+
+        int reloc_type = RELOC_ADDR12;
+        if(opcode & OPCODE_LONG){
+            obj_emit_opcode(obj, 0xf000); // address follows in the next word
+            opcode &= 0xffff;
+            reloc_type = RELOC_ADDR16;
+        }
+
+        // address operand names a label, let the linker patch it
+        if(parse_symbol_ref != NULL){
+            int symbol = obj_reference_symbol(obj, parse_symbol_ref);
+            obj_add_reloc(obj, reloc_type, obj->size, symbol);
+            // so the linker can say where a missing label was used
+            obj->relocs[obj->reloc_count - 1].line = linenumber;
+            obj->relocs[obj->reloc_count - 1].column = parse_symbol_ref - line + 1;
+        }
+        obj_emit_opcode(obj, opcode);
+    }
+
+    STATS_ENCODING(0);
+    STATS_STOP(STATS_ASSEMBLE, assemble);
+    return result;
+}
+
+int assemble_file(FILE* fp, struct object* obj, const struct asm_options* options){
+    struct source src;
+    int spill_slots = 0;
+
+    read_source(fp, &src);
+
+    int result = 0;
+    STATS_START(rewrite);
+    if(options->vregs)
+        result = allocate_vregs(&src, &spill_slots);
+    if(result == 0 && options->rules)
+        result = apply_rules(&src, options->rules);
+    STATS_STOP(STATS_REWRITE, rewrite);
+
+    if(result == 0)
+        result = assemble_source(&src, obj);
+
+    // scratch bytes for spilled virtual registers go after the code, also
+    // after errors, so the labels resolve when they are still linked
+    for(int i = 0; i < spill_slots; i++){
+        char name[32];
+        snprintf(name, sizeof(name), VREG_SPILL_LABEL "%d", i);
+        obj_define_symbol(obj, name, obj->size);
+        obj_emit_byte(obj, 0);
+    }
+
+    free_source(&src);
+    return result;
+}
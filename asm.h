@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdio.h>
+#include "object.h"
+
+struct rule_db;
+
+struct asm_options {
+    int vregs; // allocate %name virtual registers onto V0-VE
+    const struct rule_db* rules; // superoptimizer rewrites to apply, or NULL
+};
+
+struct src_line {
+    char* text; // comment already stripped
+    int linenumber;
+    uint32_t offset; // where the line's code starts, set by assemble_source
+};
+
+struct source {
+    struct src_line* lines;
+    int count, cap;
+};
+
+char* split_label(char*, char**);
+int read_source(FILE*, struct source*);
+void add_source_line(struct source*, const char*, int linenumber);
+void free_source(struct source*);
+
+int is_directive(const char*, const char* name);
+int report_parse_error(int, int linenumber, int column, const char*);
+int assemble_source(struct source*, struct object*);
+int assemble_file(FILE*, struct object*, const struct asm_options*);
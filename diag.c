@@ -0,0 +1,144 @@
+#include "diag.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+static const char* diag_path; // NULL unless --diagnostics was given
+static int diag_format;
+static const char* current_file;
+
+static struct diagnostic* diags;
+static int diag_total, diag_cap;
+
+static char* copy_string(const char* s){
+    if(s == NULL) return NULL;
+    char* copy = malloc(strlen(s) + 1);
+    if(copy == NULL){
+        printf("Error: out of memory\n");
+        exit(1);
+    }
+    strcpy(copy, s);
+    return copy;
+}
+
+void diag_open(const char* path){
+    size_t length = strlen(path);
+    diag_path = path;
+    diag_format = length >= 6 && strcmp(path + length - 6, ".sarif") == 0 ? DIAG_SARIF : DIAG_JSON;
+}
+
+void diag_set_file(const char* file){
+    current_file = file;
+}
+
+void diag_error(int code, int line, int column, const char* format, ...){
+    char message[1024];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+
+    printf("Error: %s\n", message);
+    diag_total++;
+    if(diag_path == NULL) return;
+
+    if(diag_total > diag_cap){
+        diag_cap = diag_cap ? diag_cap * 2 : 16;
+        diags = realloc(diags, diag_cap * sizeof(struct diagnostic));
+        if(diags == NULL){
+            printf("Error: out of memory\n");
+            exit(1);
+        }
+    }
+    struct diagnostic* d = &diags[diag_total - 1];
+    d->file = copy_string(current_file);
+    d->line = line;
+    d->column = column;
+    d->code = code;
+    d->message = copy_string(message);
+}
+
+int diag_count(void){
+    return diag_total;
+}
+
+static void write_string(FILE* fp, const char* s){
+    // JSON string with quotes and escapes
+    fputc('"', fp);
+    for(const unsigned char* p = (const unsigned char*)s; *p != '\0'; p++){
+        if(*p == '"' || *p == '\\')
+            fprintf(fp, "\\%c", *p);
+        else if(*p < 0x20)
+            fprintf(fp, "\\u%04x", *p);
+        else
+            fputc(*p, fp);
+    }
+    fputc('"', fp);
+}
+
+static void write_json(FILE* fp){
+    fprintf(fp, "{\n  \"diagnostics\": [");
+    for(int i = 0; i < diag_total; i++){
+        struct diagnostic* d = &diags[i];
+        fprintf(fp, "%s\n    {\"file\": ", i ? "," : "");
+        if(d->file) write_string(fp, d->file);
+        else fprintf(fp, "null");
+        fprintf(fp, ", \"line\": %d, \"column\": %d, \"code\": %d, \"message\": ",
+                d->line, d->column, d->code);
+        write_string(fp, d->message);
+        fprintf(fp, "}");
+    }
+    fprintf(fp, "%s]\n}\n", diag_total ? "\n  " : "");
+}
+
+static void write_sarif(FILE* fp){
+    // SARIF 2.1.0, one run, the rule id is the diagnostic code
+    fprintf(fp, "{\n  \"version\": \"2.1.0\",\n"
+                "  \"$schema\": \"https://json.schemastore.org/sarif-2.1.0.json\",\n"
+                "  \"runs\": [{\n"
+                "    \"tool\": {\"driver\": {\"name\": \"chip8-compiler\"}},\n"
+                "    \"results\": [");
+    for(int i = 0; i < diag_total; i++){
+        struct diagnostic* d = &diags[i];
+        fprintf(fp, "%s\n      {\"ruleId\": \"E%d\", \"level\": \"error\", \"message\": {\"text\": ",
+                i ? "," : "", d->code);
+        write_string(fp, d->message);
+        fprintf(fp, "}");
+        if(d->file){
+            fprintf(fp, ", \"locations\": [{\"physicalLocation\": {\"artifactLocation\": {\"uri\": ");
+            write_string(fp, d->file);
+            fprintf(fp, "}");
+            if(d->line > 0){
+                fprintf(fp, ", \"region\": {\"startLine\": %d", d->line);
+                if(d->column > 0) fprintf(fp, ", \"startColumn\": %d", d->column);
+                fprintf(fp, "}");
+            }
+            fprintf(fp, "}}]");
+        }
+        fprintf(fp, "}");
+    }
+    fprintf(fp, "%s]\n  }]\n}\n", diag_total ? "\n    " : "");
+}
+
+int diag_close(void){
+    int result = 0;
+    if(diag_path != NULL){
+        FILE* fp = fopen(diag_path, "w");
+        if(fp == NULL){
+            printf("Error: can't open file '%s'\n", diag_path);
+            result = 1;
+        } else {
+            if(diag_format == DIAG_SARIF) write_sarif(fp);
+            else write_json(fp);
+            fclose(fp);
+        }
+    }
+    for(int i = 0; i < diag_total && diag_path != NULL; i++){
+        free(diags[i].file);
+        free(diags[i].message);
+    }
+    free(diags);
+    diags = NULL;
+    diag_total = diag_cap = 0;
+    return result;
+}
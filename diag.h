@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdio.h>
+
+// Diagnostics
+// Every error goes through diag_error, which prints it like before and, when
+// --diagnostics is given, keeps it to be written out as JSON or SARIF at exit.
+// Every kind of error has its own code, also the SARIF rule id (E<code>).
+// Codes are never reused or renumbered. They aren't the exit status, many
+// errors share one of those.
+
+#define DIAG_JSON 0
+#define DIAG_SARIF 1
+
+// parse errors
+#define DIAG_UNKNOWN_MNEMONIC 1
+#define DIAG_LARGE_DIGIT 2
+#define DIAG_MISSING_OPERAND 3
+#define DIAG_UNKNOWN_REGISTER 4
+#define DIAG_MISSING_REGISTER 5
+#define DIAG_INVALID_OPERAND 6
+#define DIAG_DUPLICATE_LABEL 7
+// files
+#define DIAG_CANT_OPEN 8
+#define DIAG_CANT_WRITE 9
+#define DIAG_BAD_OBJECT 10
+// linking
+#define DIAG_PROGRAM_TOO_LARGE 11
+#define DIAG_DUPLICATE_SYMBOL 12
+#define DIAG_UNDEFINED_SYMBOL 13
+#define DIAG_ADDRESS_OVERFLOW 14
+#define DIAG_BAD_RELOCATION 15
+// --vregs
+#define DIAG_VREG_RANGE 16
+#define DIAG_VREG_NAME 17
+#define DIAG_VREG_COUNT 18
+#define DIAG_VREG_SPILL 19 // out of registers and nothing can be spilled
+#define DIAG_VREG_SPILL_I 20 // out of registers where I is live
+// images
+#define DIAG_IMAGE_OPEN 21
+#define DIAG_IMAGE_FORMAT 22
+#define DIAG_IMAGE_SIZE 23
+#define DIAG_SPRITE_TARGET 24 // 16x16 sprites for plain CHIP-8
+// tools
+#define DIAG_CANT_WATCH 25 // --watch can't get inotify on the directory
+#define DIAG_BAD_RULE 26 // a line of the --rules file
+
+struct diagnostic {
+    char* file; // NULL when the error isn't about a source file
+    int line, column; // 1-based, 0 when unknown
+    int code; // DIAG_ above
+    char* message;
+};
+
+void diag_open(const char* path); // format is picked by suffix, '.sarif' or JSON
+void diag_set_file(const char* file);
+void diag_error(int code, int line, int column, const char* format, ...)
+    __attribute__((format(printf, 4, 5)));
+int diag_count(void);
+// writes the collected diagnostics and forgets them, 1 if it can't. --watch
+// does that after every build, so the file always has the last one
+int diag_close(void);
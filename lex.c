@@ -0,0 +1,147 @@
+#include "lex.h"
+#include <stddef.h>
+
+// Operand lexer
+// One pass over the token with a byte class table tells registers, special
+// operands, numbers and label names apart, and gives a number's value.
+
+#define CL_DIGIT 0x1 // 0-9
+#define CL_HEX 0x2 // A-F, a-f
+#define CL_ALPHA 0x4 // letters
+#define CL_PUNCT 0x8 // '_' and '.', allowed in label names
+#define CL_SEP 0x10 // splits tokens
+#define CL_NAME (CL_DIGIT | CL_ALPHA | CL_PUNCT)
+
+static const unsigned char byte_class[256] = {
+    ['0' ... '9'] = CL_DIGIT,
+    ['A' ... 'F'] = CL_ALPHA | CL_HEX,
+    ['G' ... 'Z'] = CL_ALPHA,
+    ['a' ... 'f'] = CL_ALPHA | CL_HEX,
+    ['g' ... 'z'] = CL_ALPHA,
+    ['_'] = CL_PUNCT,
+    ['.'] = CL_PUNCT,
+    [' '] = CL_SEP,
+    [','] = CL_SEP,
+    ['\n'] = CL_SEP,
+};
+
+// value of a digit or hex letter, for any case
+#define DIGIT_VALUE(c) (((c) & 0xf) + 9 * ((c) >> 6))
+
+int is_symbol_name(const char* name){
+    // label names: letter, '_' or '.' first, then letters, digits, '_' or '.'
+    const unsigned char* p = (const unsigned char*)name;
+    if(!(byte_class[p[0]] & (CL_ALPHA | CL_PUNCT)))
+        return 0;
+    while(byte_class[*++p] & CL_NAME)
+        ;
+    return *p == '\0';
+}
+
+int lex_tokens(char* line, char** tokens, int max){
+    // splits line in place on ' ', ',' and '\n', like strtok with those delimiters
+    unsigned char* p = (unsigned char*)line;
+    int count = 0;
+    while(count < max){
+        while(byte_class[*p] & CL_SEP) p++;
+        if(*p == '\0') break;
+        tokens[count++] = (char*)p;
+        while(*p != '\0' && !(byte_class[*p] & CL_SEP)) p++;
+        if(*p == '\0') break;
+        *p++ = '\0';
+    }
+    return count;
+}
+
+static void lex_number(const unsigned char* p, struct operand* op){
+    // decimal, 0x hex, 0b binary, and a leading 0 is octal like strtol does
+    int base = 10;
+    if(*p == '+') p++;
+    if(p[0] == '0' && (p[1] | 0x20) == 'x'){
+        base = 16;
+        p += 2;
+    } else if(p[0] == '0' && (p[1] | 0x20) == 'b'){
+        base = 2;
+        p += 2;
+    } else if(p[0] == '0' && p[1] != '\0'){
+        base = 8;
+        p++;
+    }
+
+    if(*p == '\0'){
+        op->kind = OPERAND_INVALID;
+        return;
+    }
+
+    unsigned value = 0;
+    for(; *p != '\0'; p++){
+        unsigned digit = DIGIT_VALUE(*p);
+        if(!(byte_class[*p] & (CL_DIGIT | CL_HEX)) || digit >= (unsigned)base){
+            op->kind = OPERAND_INVALID;
+            return;
+        }
+        value = value * base + digit;
+        if(value > 0x10000) value = 0x10000; // anything bigger is just too big
+    }
+
+    op->kind = OPERAND_NUMBER;
+    op->value = value;
+    op->range = (value > 0xf) + (value > 0xff) + (value > 0xfff) + (value > 0xffff);
+}
+
+void lex_operand(char* text, struct operand* op){
+    op->text = text;
+    op->value = 0;
+    op->range = RANGE_OVER;
+    op->is_name = 0;
+
+    if(text == NULL){
+        op->kind = OPERAND_NONE;
+        return;
+    }
+
+    const unsigned char* p = (const unsigned char*)text;
+    int cls = byte_class[p[0]];
+
+    if((cls & CL_DIGIT) || p[0] == '+'){
+        lex_number(p, op);
+        return;
+    }
+
+    if(p[0] == '[' && p[1] == 'I' && p[2] == ']' && p[3] == '\0'){
+        op->kind = OPERAND_SPECIAL;
+        op->value = SPECIAL_I_MEM;
+        return;
+    }
+
+    if(!(cls & (CL_ALPHA | CL_PUNCT))){
+        op->kind = OPERAND_INVALID;
+        return;
+    }
+
+    int length = 1;
+    while(byte_class[p[length]] & CL_NAME) length++;
+    if(p[length] != '\0'){
+        op->kind = OPERAND_INVALID;
+        return;
+    }
+    op->is_name = 1;
+    op->kind = OPERAND_SYMBOL;
+
+    if(length == 1){
+        switch(p[0]){
+            case 'I': op->kind = OPERAND_SPECIAL; op->value = SPECIAL_I; break;
+            case 'F': op->kind = OPERAND_SPECIAL; op->value = SPECIAL_F; break;
+            case 'B': op->kind = OPERAND_SPECIAL; op->value = SPECIAL_B; break;
+            case 'K': op->kind = OPERAND_SPECIAL; op->value = SPECIAL_K; break;
+        }
+    } else if(length == 2){
+        if(p[0] == 'V' && ((byte_class[p[1]] & CL_DIGIT) || (p[1] >= 'A' && p[1] <= 'F'))){
+            op->kind = OPERAND_REG;
+            op->value = DIGIT_VALUE(p[1]);
+        } else if(p[1] == 'T' && (p[0] == 'S' || p[0] == 'D')){
+            op->kind = OPERAND_SPECIAL;
+            op->value = p[0] == 'S' ? SPECIAL_ST : SPECIAL_DT;
+        }
+    }
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+// operand kinds
+#define OPERAND_NONE 0 // missing
+#define OPERAND_INVALID 1
+#define OPERAND_REG 2 // Vx, value is x
+#define OPERAND_SPECIAL 3 // value is one of SPECIAL_*
+#define OPERAND_NUMBER 4
+#define OPERAND_SYMBOL 5
+
+#define SPECIAL_I_MEM 0x1 // [I]
+#define SPECIAL_ST 0x2
+#define SPECIAL_DT 0x3
+#define SPECIAL_I 0x4
+#define SPECIAL_F 0x5
+#define SPECIAL_B 0x6
+#define SPECIAL_K 0x7
+
+// smallest field a number fits into
+#define RANGE_NIBBLE 0 // 0x0-0xF
+#define RANGE_BYTE 1 // up to 0xFF
+#define RANGE_ADDR 2 // up to 0xFFF
+#define RANGE_WORD 3 // up to 0xFFFF
+#define RANGE_OVER 4
+
+struct operand {
+    char* text;
+    int kind;
+    int value;
+    int range; // for numbers
+    int is_name; // could also be a label name (like 'B' or 'V1')
+};
+
+int lex_tokens(char* line, char** tokens, int max);
+void lex_operand(char*, struct operand*);
+int is_symbol_name(const char*);
@@ -0,0 +1,103 @@
+#include "link.h"
+#include "diag.h"
+#include "stats.h"
+#include <stdlib.h>
+#include <string.h>
+
+int link_objects(struct object* objs, int count, size_t limit, FILE* outp){
+    // Step 1: lay objects out one after another starting at PROGRAM_START
+    // Step 2: collect global symbols into one table (duplicates are errors)
+    // Step 3: patch every relocation with the resolved address
+    // Step 4: write the image, unless outp is NULL
+    STATS_START(link);
+    uint32_t* base = malloc((count + 1) * sizeof(uint32_t));
+    if(base == NULL){
+        printf("Error: out of memory\n");
+        exit(1);
+    }
+    base[0] = PROGRAM_START;
+    for(int i = 0; i < count; i++)
+        base[i + 1] = base[i] + objs[i].size;
+
+    int result = 0;
+    size_t image_size = base[count] - PROGRAM_START;
+    if(image_size > limit){
+        diag_error(DIAG_PROGRAM_TOO_LARGE, 0, 0, "program is %zu bytes, only %zu fit into memory", image_size, limit);
+        free(base);
+        return ERR_PROGRAM_TOO_LARGE;
+    }
+
+    struct object globals; // symbol offsets here are absolute addresses
+    obj_init(&globals);
+    for(int i = 0; i < count; i++){
+        for(size_t s = 0; s < objs[i].sym_count; s++){
+            struct symbol* sym = &objs[i].syms[s];
+            if(sym->flags != SYM_GLOBAL) continue;
+            if(obj_define_symbol(&globals, sym->name, base[i] + sym->offset) == ERR_DUPLICATE_SYMBOL){
+                diag_error(DIAG_DUPLICATE_SYMBOL, 0, 0, "symbol '%s' is defined more than once", sym->name);
+                result = ERR_DUPLICATE_SYMBOL;
+            }
+        }
+    }
+
+    // every missing symbol is reported once, not for each use
+    struct object missing;
+    obj_init(&missing);
+    for(int i = 0; i < count && result != ERR_DUPLICATE_SYMBOL; i++){
+        struct object* obj = &objs[i];
+        for(size_t r = 0; r < obj->reloc_count; r++){
+            struct reloc* rel = &obj->relocs[r];
+            struct symbol* sym = &obj->syms[rel->symbol];
+            uint32_t address;
+            char where[32] = ""; // only known when the object was just assembled
+            if(rel->line > 0) snprintf(where, sizeof(where), " on line %d", rel->line);
+
+            if(sym->flags == SYM_UNDEFINED){
+                int id = obj_find_symbol(&globals, sym->name);
+                if(id == -1){
+                    if(obj_define_symbol(&missing, sym->name, 0) != ERR_DUPLICATE_SYMBOL)
+                        diag_error(DIAG_UNDEFINED_SYMBOL, rel->line, rel->column, "undefined symbol '%s'%s", sym->name, where);
+                    if(result == 0) result = ERR_UNDEFINED_SYMBOL;
+                    continue;
+                }
+                address = globals.syms[id].offset;
+            } else {
+                address = base[i] + sym->offset;
+            }
+
+            uint8_t* at = obj->code + rel->offset;
+            switch(rel->type){
+                case RELOC_ADDR12:
+                    if(address > 0xFFF){
+                        diag_error(DIAG_ADDRESS_OVERFLOW, rel->line, rel->column, "address of '%s' does not fit into 12 bits%s "
+                                   "(XO-CHIP can reach it with 'LD I, LONG')", sym->name, where);
+                        if(result == 0) result = ERR_ADDRESS_OVERFLOW;
+                        break;
+                    }
+                    at[0] = (at[0] & 0xf0) | (address >> 8);
+                    at[1] = address & 0xff;
+                    break;
+                case RELOC_ADDR16:
+                    at[0] = address >> 8;
+                    at[1] = address & 0xff;
+                    break;
+                default:
+                    diag_error(DIAG_BAD_RELOCATION, 0, 0, "unknown relocation type %d", rel->type);
+                    if(result == 0) result = ERR_BAD_OBJECT;
+                    break;
+            }
+        }
+    }
+    obj_free(&missing);
+
+    STATS_STOP(STATS_LINK, link);
+
+    STATS_START(write);
+    for(int i = 0; i < count && result == 0 && outp != NULL; i++)
+        fwrite(objs[i].code, 1, objs[i].size, outp);
+    STATS_STOP(STATS_WRITE, write);
+
+    obj_free(&globals);
+    free(base);
+    return result;
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+#include <stdio.h>
+#include "object.h"
+
+// outp NULL only resolves symbols, to report their errors
+int link_objects(struct object*, int, size_t limit, FILE* outp);
@@ -5,83 +5,344 @@
 
 #include "parse.h"
 #include "utils.h"
+#include "object.h"
+#include "asm.h"
+#include "link.h"
+#include "vreg.h"
+#include "superopt.h"
+#include "watch.h"
+#include "diag.h"
+#include "sprite.h"
+#include "stats.h"
+#include "lex.h"
 
 
-int main(int argc, char* argv[]){
-    // --- Arguments Parsing ---
-    if(argc < 2){
-        printf("Usage: '%s' <source_code_file>\n", argv[0]);
-        return 1;
-    }
+static size_t program_limit = PROGRAM_LIMIT; // depends on --target
 
-    FILE *fp = fopen(argv[1], "r"); // source code
+void print_usage(const char* name){
+    printf("Usage: '%s' [options] <source_code_file>\n", name);
+    printf("       '%s' -c <source_code_file>...        (write .o8 objects)\n", name);
+    printf("       '%s' --link <output.ch8> <object>... (link objects)\n", name);
+    printf("       '%s' --sprites <image>...            (PBM/PGM images to .o8 sprites)\n", name);
+    printf("Options:\n");
+    printf("  --target NAME  chip8 (default), schip or xochip\n");
+    printf("  --vregs        allocate %%name virtual registers onto V0-VE\n");
+    printf("  --rules FILE   apply superoptimizer rules from FILE\n");
+    printf("  --watch        assemble again on every save of the source\n");
+    printf("  --diagnostics FILE  also write all errors to FILE as JSON, or SARIF\n");
+    printf("                 if FILE ends with '.sarif'\n");
+    printf("  --stats[=json] print timings, line and mnemonic counts and sizes at exit\n");
+    printf("  --threshold N  --sprites: gray levels below N (0-255) are lit, default %d\n", SPRITE_THRESHOLD);
+    printf("  --sprite-rows N  --sprites: rows of a sprite (1-15), 16 for 16x16 sprites\n");
+    printf("  --superopt     search the sources for shorter sequences and add them\n");
+    printf("                 to the rules file (default '%s')\n", SUPEROPT_DEFAULT_RULES);
+}
+
+int compile_file(const char* source, struct object* obj, const struct asm_options* options){
+    obj_init(obj);
+    diag_set_file(source);
+    STATS_FILE();
+    FILE *fp = fopen(source, "r"); // source code
     if(fp == NULL){
-        printf("Error: can't open file '%s'\n", argv[1]);
+        diag_error(DIAG_CANT_OPEN, 0, 0, "can't open file '%s'", source);
         return 1;
     }
+    int result = assemble_file(fp, obj, options);
+    fclose(fp);
+    return result;
+}
 
-    char* bin_file = get_filename_for_binary(argv[1]);
+int write_binary(const char* bin_file, struct object* objs, int count){
     FILE *outp = fopen(bin_file, "wb");
+    if(outp == NULL){
+        diag_error(DIAG_CANT_OPEN, 0, 0, "can't open file '%s'", bin_file);
+        return 1;
+    }
+    int result = link_objects(objs, count, program_limit, outp);
+    if(result == 0)
+        STATS_OUTPUT(ftell(outp), ftell(outp), program_limit);
+    fclose(outp);
+    if(result != 0){
+        remove(bin_file); // don't leave half-linked image behind
+        return 8;
+    }
+    return 0;
+}
 
-    
-    char line[1024]; // more that enough for one line
-    int linenumber = 1;
-    char *comment_start = NULL;
-    int is_empty;
-
-    while(fgets(line, sizeof(line), fp) != NULL){
-        // find comments
-        comment_start = strchr(line, ';'); // 
-        if (comment_start != NULL) {
-            *comment_start = '\0'; // turn ';' into \0, so it's the end of C-string now
-        }
+int write_object(const char* source, struct object* obj){
+    // writes obj next to source with the .o8 suffix
+    char* obj_file = get_filename_with_suffix(source, ".o8");
+    FILE *outp = fopen(obj_file, "wb");
+    if(outp == NULL){
+        diag_error(DIAG_CANT_OPEN, 0, 0, "can't open file '%s'", obj_file);
+        free(obj_file);
+        return 1;
+    }
+    STATS_START(write);
+    int result = obj_write(obj, outp);
+    STATS_STOP(STATS_WRITE, write);
+    STATS_OUTPUT(ftell(outp), obj->size, program_limit);
+    fclose(outp);
+    if(result != 0){
+        diag_error(DIAG_CANT_WRITE, 0, 0, "can't write object '%s'", obj_file);
+        result = 1;
+    }
+    free(obj_file);
+    return result;
+}
 
-        is_empty = 1;
-        for (int i = 0; line[i] != '\0'; i++) {
-            if (!isspace((unsigned char)line[i])) { 
-                is_empty = 0;
-                break;
-            }
+int compile_objects(int count, char* sources[], const struct asm_options* options){
+    // -c: every source becomes its own .o8, so only changed ones need reassembly.
+    // A broken source doesn't stop the others, the first error is the exit status.
+    int status = 0;
+    for(int i = 0; i < count; i++){
+        struct object obj;
+        int result = compile_file(sources[i], &obj, options);
+        if(result == 0)
+            result = write_object(sources[i], &obj);
+        obj_free(&obj);
+        if(result != 0 && status == 0) status = result;
+    }
+    return status;
+}
+
+char* label_from_filename(const char* path){
+    // 'art/hero-walk.pbm' is 'hero_walk'
+    const char* name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+    const char* dot = strrchr(name, '.');
+    size_t length = dot && dot != name ? (size_t)(dot - name) : strlen(name);
+
+    char* label = malloc(length + 2);
+    if(label == NULL){
+        printf("Error: out of memory\n");
+        exit(1);
+    }
+    char* out = label;
+    if(length == 0 || isdigit((unsigned char)name[0])) *out++ = '_';
+    for(size_t i = 0; i < length; i++)
+        *out++ = isalnum((unsigned char)name[i]) ? name[i] : '_';
+    *out = '\0';
+    return label;
+}
+
+static int option_number(char* text, int min, int max){
+    // numbers are written like in the source, -1 if it isn't one in range
+    struct operand op;
+    lex_operand(text, &op);
+    if(op.kind != OPERAND_NUMBER || op.value < min || op.value > max) return -1;
+    return op.value;
+}
+
+int convert_sprites(int count, char* images[], int threshold, int rows){
+    // --sprites: every image becomes a .o8 with its sprites under a global label
+    // named after the file, ready to be linked into a program
+    if(rows == SPRITE_BIG && parse_get_target() == TARGET_CHIP8){
+        diag_error(DIAG_SPRITE_TARGET, 0, 0, "16x16 sprites need --target schip or xochip");
+        return 1;
+    }
+    int status = 0;
+    for(int i = 0; i < count; i++){
+        struct object obj;
+        obj_init(&obj);
+        diag_set_file(images[i]);
+        char* label = label_from_filename(images[i]);
+        obj_define_symbol(&obj, label, 0);
+        int result = sprite_include(&obj, images[i], label, threshold, rows, 0);
+        if(result == 0)
+            result = write_object(images[i], &obj);
+        if(result != 0 && status == 0) status = result;
+        free(label);
+        obj_free(&obj);
+    }
+    return status;
+}
+
+int link_files(const char* bin_file, int count, char* obj_files[]){
+    struct object* objs = calloc(count, sizeof(struct object));
+    if(objs == NULL){
+        printf("Error: out of memory\n");
+        return 1;
+    }
+
+    int result = 0;
+    for(int i = 0; i < count; i++){
+        diag_set_file(obj_files[i]);
+        FILE *fp = fopen(obj_files[i], "rb");
+        if(fp == NULL){
+            diag_error(DIAG_CANT_OPEN, 0, 0, "can't open file '%s'", obj_files[i]);
+            if(result == 0) result = 1;
+            continue;
         }
-        if (is_empty) {
-            linenumber++;
-            continue; 
+        if(obj_read(&objs[i], fp) != 0){
+            diag_error(DIAG_BAD_OBJECT, 0, 0, "'%s' is not a valid object file", obj_files[i]);
+            if(result == 0) result = 8;
+        }
+        fclose(fp);
+    }
+    diag_set_file(NULL); // link errors are about the whole program
+
+    if(result == 0)
+        result = write_binary(bin_file, objs, count);
+
+    for(int i = 0; i < count; i++)
+        obj_free(&objs[i]);
+    free(objs);
+    return result;
+}
+
+int superopt_files(int count, char* sources[], const struct asm_options* options, const char* rules_file){
+    // look for shorter sequences in every source and grow the rule database
+    struct rule_db rules;
+    if(rules_load(&rules, rules_file, 1) != 0)
+        return 1;
+
+    int result = 0;
+    for(int i = 0; i < count && result == 0; i++){
+        diag_set_file(sources[i]);
+        FILE *fp = fopen(sources[i], "r");
+        if(fp == NULL){
+            diag_error(DIAG_CANT_OPEN, 0, 0, "can't open file '%s'", sources[i]);
+            result = 1;
+            break;
         }
+        struct source src;
+        int spill_slots;
+        read_source(fp, &src);
+        fclose(fp);
+        if(options->vregs)
+            result = allocate_vregs(&src, &spill_slots);
+        if(result == 0)
+            result = superoptimize_source(&src, &rules, rules_file);
+        free_source(&src);
+    }
 
+    rules_free(&rules);
+    return result;
+}
 
-        int opcode = parse_for_opcode(line);
 
-        // check for error on parsing
-        switch(opcode){
-            case ERR_UNKNOWN_MNEMONIC:
-                printf("Error: unknown mnemonic on line %d '%s'\n", linenumber, line);
+int finish(int result){
+    // everything that is reported once at exit
+    if(diag_close() != 0 && result == 0) result = 1;
+    STATS_REPORT();
+    return result;
+}
+
+int main(int argc, char* argv[]){
+    // --- Arguments Parsing ---
+    struct asm_options options = {0};
+    struct rule_db rules;
+    const char* rules_file = NULL;
+    int superopt = 0;
+    int watch = 0;
+    int threshold = SPRITE_THRESHOLD;
+    int sprite_rows = 0;
+
+    // options go first
+    int arg = 1;
+    while(arg < argc && strncmp(argv[arg], "--", 2) == 0 && strcmp(argv[arg], "--link") != 0 &&
+          strcmp(argv[arg], "--sprites") != 0){
+        if(strcmp(argv[arg], "--vregs") == 0){
+            options.vregs = 1;
+        } else if(strcmp(argv[arg], "--rules") == 0 && arg + 1 < argc){
+            rules_file = argv[++arg];
+        } else if(strcmp(argv[arg], "--superopt") == 0){
+            superopt = 1;
+        } else if(strcmp(argv[arg], "--watch") == 0){
+            watch = 1;
+        } else if(strcmp(argv[arg], "--diagnostics") == 0 && arg + 1 < argc){
+            diag_open(argv[++arg]);
+        } else if(strcmp(argv[arg], "--stats") == 0 || strcmp(argv[arg], "--stats=json") == 0){
+            if(!STATS_ENABLED){
+                printf("Error: built with NO_STATS, --stats is not available\n");
+                return 1;
+            }
+            STATS_ENABLE(argv[arg][7] == '=');
+        } else if(strcmp(argv[arg], "--threshold") == 0 && arg + 1 < argc){
+            threshold = option_number(argv[++arg], 0, 255);
+            if(threshold == -1){
+                printf("Error: threshold must be 0-255\n");
+                return 1;
+            }
+        } else if(strcmp(argv[arg], "--sprite-rows") == 0 && arg + 1 < argc){
+            sprite_rows = option_number(argv[++arg], 1, SPRITE_BIG);
+            if(sprite_rows == -1){
+                printf("Error: sprite rows must be 1-16\n");
+                return 1;
+            }
+        } else if(strcmp(argv[arg], "--target") == 0 && arg + 1 < argc){
+            int target = parse_target_from_name(argv[++arg]);
+            if(target == -1){
+                printf("Error: unknown target '%s'\n", argv[arg]);
                 return 1;
-            case ERR_LARGE_DIGIT:
-                printf("Error: too large digit on line %d '%s'\n", linenumber, line);
-                return 2;
-            case ERR_MISSING_OPERAND:
-                printf("Error: missing operand on line %d '%s'\n", linenumber, line);
-                return 3;
-            case REG_ERR_UNKNOWN:
-                printf("Error: unknown register number on line %d '%s'\n", linenumber, line);
-                return 4;
-            case REG_ERR_MISSING:
-                printf("Error: missing register number on line %d '%s'\n", linenumber, line);
-                return 5;
-            case ERR_INVALID_OPERAND:
-                printf("Error: invalid operand on line %d '%s'\n", linenumber, line);
-                return 6;
+            }
+            parse_set_target(target);
+            program_limit = target == TARGET_XOCHIP ? XOCHIP_PROGRAM_LIMIT : PROGRAM_LIMIT;
+        } else {
+            printf("Error: unknown option '%s'\n", argv[arg]);
+            return 1;
         }
-        linenumber++;
+        arg++;
+    }
+    argc -= arg - 1;
+    argv += arg - 1;
 
-        fputc(((opcode & 0xff00) >> 8), outp); // writing high byte
-        fputc((opcode & 0xff), outp); // writing lowest byte
+    if(argc < 2){
+        print_usage(argv[0]);
+        return 1;
     }
-    
 
-    fclose(fp);
-    fclose(outp);
-    free(bin_file);
-    return 0;
-}
+    int result;
+    if(superopt){
+        result = superopt_files(argc - 1, argv + 1, &options,
+                                rules_file ? rules_file : SUPEROPT_DEFAULT_RULES);
+        return finish(result);
+    }
+
+    if(strcmp(argv[1], "-c") == 0 && argc < 3){
+        print_usage(argv[0]);
+        return 1;
+    }
+    if(strcmp(argv[1], "--link") == 0 && argc < 4){
+        print_usage(argv[0]);
+        return 1;
+    }
+    if(strcmp(argv[1], "--sprites") == 0){
+        if(argc < 3){
+            print_usage(argv[0]);
+            return 1;
+        }
+        result = convert_sprites(argc - 2, argv + 2, threshold, sprite_rows);
+        return finish(result);
+    }
+
+    if(rules_file != NULL){
+        if(rules_load(&rules, rules_file, 0) != 0)
+            return finish(1);
+        options.rules = &rules;
+    }
 
+    if(strcmp(argv[1], "-c") == 0){
+        result = compile_objects(argc - 2, argv + 2, &options);
+    } else if(strcmp(argv[1], "--link") == 0){
+        result = link_files(argv[2], argc - 3, argv + 3);
+    } else if(watch){
+        result = watch_file(argv[1], &options, program_limit);
+    } else {
+        // assemble and link one source in one go
+        struct object obj;
+        result = compile_file(argv[1], &obj, &options);
+        if(result == 0){
+            char* bin_file = get_filename_for_binary(argv[1]);
+            result = write_binary(bin_file, &obj, 1);
+            free(bin_file);
+        } else {
+            link_objects(&obj, 1, program_limit, NULL); // undefined labels too
+        }
+        obj_free(&obj);
+    }
+
+    if(options.rules) rules_free(&rules);
+    return finish(result);
+}
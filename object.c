@@ -0,0 +1,235 @@
+#include "object.h"
+#include <stdlib.h>
+#include <string.h>
+
+static void* grow(void* ptr, size_t* cap, size_t needed, size_t item_size){
+    // make room for 'needed' items, doubling capacity
+    if(needed <= *cap) return ptr;
+    size_t new_cap = *cap ? *cap : 16;
+    while(new_cap < needed) new_cap *= 2;
+    void* p = realloc(ptr, new_cap * item_size);
+    if(p == NULL){
+        printf("Error: out of memory\n");
+        exit(1);
+    }
+    *cap = new_cap;
+    return p;
+}
+
+uint32_t hash_string(const char* s){
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    while(*s){
+        h ^= (uint8_t)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+void obj_init(struct object* obj){
+    memset(obj, 0, sizeof(*obj));
+}
+
+void obj_free(struct object* obj){
+    for(size_t i = 0; i < obj->sym_count; i++)
+        free(obj->syms[i].name);
+    free(obj->syms);
+    free(obj->code);
+    free(obj->relocs);
+    free(obj->sym_index);
+    obj_init(obj);
+}
+
+void obj_emit_byte(struct object* obj, uint8_t byte){
+    obj->code = grow(obj->code, &obj->code_cap, obj->size + 1, 1);
+    obj->code[obj->size++] = byte;
+}
+
+void obj_emit_opcode(struct object* obj, int opcode){
+    obj_emit_byte(obj, (opcode & 0xff00) >> 8); // high byte first
+    obj_emit_byte(obj, opcode & 0xff);
+}
+
+static void rebuild_index(struct object* obj){
+    // keep load factor under 1/2
+    size_t cap = obj->index_cap ? obj->index_cap : 64;
+    while(cap < obj->sym_count * 2 + 2) cap *= 2;
+
+    free(obj->sym_index);
+    obj->sym_index = malloc(cap * sizeof(int32_t));
+    if(obj->sym_index == NULL){
+        printf("Error: out of memory\n");
+        exit(1);
+    }
+    obj->index_cap = cap;
+    for(size_t i = 0; i < cap; i++) obj->sym_index[i] = -1;
+
+    for(size_t i = 0; i < obj->sym_count; i++){
+        size_t slot = hash_string(obj->syms[i].name) & (cap - 1);
+        while(obj->sym_index[slot] != -1) slot = (slot + 1) & (cap - 1);
+        obj->sym_index[slot] = (int32_t)i;
+    }
+}
+
+int obj_find_symbol(const struct object* obj, const char* name){
+    if(obj->index_cap == 0) return -1;
+    size_t slot = hash_string(name) & (obj->index_cap - 1);
+    while(obj->sym_index[slot] != -1){
+        if(strcmp(obj->syms[obj->sym_index[slot]].name, name) == 0)
+            return obj->sym_index[slot];
+        slot = (slot + 1) & (obj->index_cap - 1);
+    }
+    return -1;
+}
+
+static int add_symbol(struct object* obj, const char* name, uint32_t offset, uint8_t flags){
+    obj->syms = grow(obj->syms, &obj->sym_cap, obj->sym_count + 1, sizeof(struct symbol));
+    struct symbol* sym = &obj->syms[obj->sym_count];
+    sym->name = malloc(strlen(name) + 1);
+    if(sym->name == NULL){
+        printf("Error: out of memory\n");
+        exit(1);
+    }
+    strcpy(sym->name, name);
+    sym->offset = offset;
+    sym->flags = flags;
+    obj->sym_count++;
+
+    if(obj->sym_count * 2 + 2 > obj->index_cap){
+        rebuild_index(obj);
+    } else {
+        size_t slot = hash_string(name) & (obj->index_cap - 1);
+        while(obj->sym_index[slot] != -1) slot = (slot + 1) & (obj->index_cap - 1);
+        obj->sym_index[slot] = (int32_t)(obj->sym_count - 1);
+    }
+    return (int)(obj->sym_count - 1);
+}
+
+int obj_define_symbol(struct object* obj, const char* name, uint32_t offset){
+    // labels starting with '.' are local to the file
+    uint8_t flags = name[0] == '.' ? SYM_LOCAL : SYM_GLOBAL;
+    int id = obj_find_symbol(obj, name);
+    if(id == -1)
+        return add_symbol(obj, name, offset, flags);
+
+    // label was used before its definition
+    if(obj->syms[id].flags != SYM_UNDEFINED)
+        return ERR_DUPLICATE_SYMBOL;
+    obj->syms[id].offset = offset;
+    obj->syms[id].flags = flags;
+    return id;
+}
+
+int obj_reference_symbol(struct object* obj, const char* name){
+    int id = obj_find_symbol(obj, name);
+    if(id != -1) return id;
+    return add_symbol(obj, name, 0, SYM_UNDEFINED);
+}
+
+void obj_add_reloc(struct object* obj, uint8_t type, uint32_t offset, uint32_t symbol){
+    obj->relocs = grow(obj->relocs, &obj->reloc_cap, obj->reloc_count + 1, sizeof(struct reloc));
+    obj->relocs[obj->reloc_count].type = type;
+    obj->relocs[obj->reloc_count].offset = offset;
+    obj->relocs[obj->reloc_count].symbol = symbol;
+    obj->relocs[obj->reloc_count].line = 0;
+    obj->relocs[obj->reloc_count].column = 0;
+    obj->reloc_count++;
+}
+
+static void put_u16(FILE* fp, uint32_t v){
+    fputc(v & 0xff, fp);
+    fputc((v >> 8) & 0xff, fp);
+}
+
+static void put_u32(FILE* fp, uint32_t v){
+    put_u16(fp, v & 0xffff);
+    put_u16(fp, v >> 16);
+}
+
+static int get_u16(FILE* fp, uint32_t* v){
+    int lo = fgetc(fp);
+    int hi = fgetc(fp);
+    if(lo == EOF || hi == EOF) return ERR_BAD_OBJECT;
+    *v = (uint32_t)lo | (uint32_t)hi << 8;
+    return 0;
+}
+
+static int get_u32(FILE* fp, uint32_t* v){
+    uint32_t lo, hi;
+    if(get_u16(fp, &lo) || get_u16(fp, &hi)) return ERR_BAD_OBJECT;
+    *v = lo | hi << 16;
+    return 0;
+}
+
+int obj_write(const struct object* obj, FILE* fp){
+    fwrite(OBJ_MAGIC, 1, 3, fp);
+    fputc(OBJ_VERSION, fp);
+    put_u32(fp, obj->size);
+    put_u32(fp, obj->sym_count);
+    put_u32(fp, obj->reloc_count);
+
+    fwrite(obj->code, 1, obj->size, fp);
+
+    for(size_t i = 0; i < obj->sym_count; i++){
+        size_t len = strlen(obj->syms[i].name);
+        fputc(obj->syms[i].flags, fp);
+        put_u32(fp, obj->syms[i].offset);
+        put_u16(fp, len);
+        fwrite(obj->syms[i].name, 1, len, fp);
+    }
+
+    for(size_t i = 0; i < obj->reloc_count; i++){
+        fputc(obj->relocs[i].type, fp);
+        put_u32(fp, obj->relocs[i].offset);
+        put_u32(fp, obj->relocs[i].symbol);
+    }
+
+    return ferror(fp) ? ERR_BAD_OBJECT : 0;
+}
+
+int obj_read(struct object* obj, FILE* fp){
+    char magic[4];
+    uint32_t code_size, sym_count, reloc_count;
+
+    obj_init(obj);
+    if(fread(magic, 1, 4, fp) != 4 || memcmp(magic, OBJ_MAGIC, 3) != 0 || magic[3] != OBJ_VERSION)
+        return ERR_BAD_OBJECT;
+    if(get_u32(fp, &code_size) || get_u32(fp, &sym_count) || get_u32(fp, &reloc_count))
+        return ERR_BAD_OBJECT;
+
+    obj->code = grow(NULL, &obj->code_cap, code_size ? code_size : 1, 1);
+    if(fread(obj->code, 1, code_size, fp) != code_size)
+        return ERR_BAD_OBJECT;
+    obj->size = code_size;
+
+    char name[65536];
+    for(uint32_t i = 0; i < sym_count; i++){
+        int flags = fgetc(fp);
+        uint32_t offset, len;
+        if(flags == EOF || get_u32(fp, &offset) || get_u16(fp, &len))
+            return ERR_BAD_OBJECT;
+        if(fread(name, 1, len, fp) != len)
+            return ERR_BAD_OBJECT;
+        // a label can sit right after the last byte, but not past it
+        if(flags > SYM_UNDEFINED || offset > code_size)
+            return ERR_BAD_OBJECT;
+        name[len] = '\0';
+        // names are unique inside an object, so skip the lookup
+        add_symbol(obj, name, offset, (uint8_t)flags);
+    }
+
+    for(uint32_t i = 0; i < reloc_count; i++){
+        int type = fgetc(fp);
+        uint32_t offset, symbol;
+        if(type == EOF || get_u32(fp, &offset) || get_u32(fp, &symbol))
+            return ERR_BAD_OBJECT;
+        // offset + 2 could wrap around, so compare without adding
+        if(symbol >= sym_count || code_size < 2 || offset > code_size - 2)
+            return ERR_BAD_OBJECT;
+        if(type != RELOC_ADDR12 && type != RELOC_ADDR16)
+            return ERR_BAD_OBJECT;
+        obj_add_reloc(obj, (uint8_t)type, offset, symbol);
+    }
+
+    return 0;
+}
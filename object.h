@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// Relocatable object file (.o8)
+// All integers are little-endian. Layout:
+//   "C8O" version(u8) code_size(u32) sym_count(u32) reloc_count(u32)
+//   code bytes
+//   sym_count * { flags(u8) offset(u32) name_len(u16) name }
+//   reloc_count * { type(u8) offset(u32) symbol(u32) }
+// CHIP-8 code and data share one address space, so there is a single section.
+#define OBJ_MAGIC "C8O"
+#define OBJ_VERSION 1
+
+#define PROGRAM_START 0x200
+#define PROGRAM_LIMIT 0xE00 // bytes from 0x200 up to the end of 4K memory
+#define XOCHIP_PROGRAM_LIMIT 0xFE00 // XO-CHIP has 64K
+
+#define SYM_LOCAL 0x0 // labels starting with '.', visible only inside its file
+#define SYM_GLOBAL 0x1
+#define SYM_UNDEFINED 0x2 // referenced here, defined in another object
+
+#define RELOC_ADDR12 0x1 // low 12 bits of the opcode at offset
+#define RELOC_ADDR16 0x2 // 16 bit word at offset (XO-CHIP 'F000 NNNN')
+
+#define ERR_DUPLICATE_SYMBOL -7
+#define ERR_UNDEFINED_SYMBOL -8
+#define ERR_BAD_OBJECT -9
+#define ERR_PROGRAM_TOO_LARGE -10
+#define ERR_ADDRESS_OVERFLOW -11
+
+struct symbol {
+    char* name;
+    uint32_t offset;
+    uint8_t flags;
+};
+
+struct reloc {
+    uint8_t type;
+    uint32_t offset;
+    uint32_t symbol; // index into object symbols
+    int line, column; // of the reference, only in memory, 0 when read from a file
+};
+
+struct object {
+    uint8_t* code;
+    size_t size, code_cap;
+
+    struct symbol* syms;
+    size_t sym_count, sym_cap;
+
+    struct reloc* relocs;
+    size_t reloc_count, reloc_cap;
+
+    // open addressing index over syms, -1 is an empty slot
+    int32_t* sym_index;
+    size_t index_cap;
+};
+
+void obj_init(struct object*);
+void obj_free(struct object*);
+
+void obj_emit_byte(struct object*, uint8_t);
+void obj_emit_opcode(struct object*, int);
+
+int obj_find_symbol(const struct object*, const char*);
+int obj_define_symbol(struct object*, const char*, uint32_t offset);
+int obj_reference_symbol(struct object*, const char*);
+void obj_add_reloc(struct object*, uint8_t type, uint32_t offset, uint32_t symbol);
+
+int obj_write(const struct object*, FILE*);
+int obj_read(struct object*, FILE*);
+
+uint32_t hash_string(const char*);
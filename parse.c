@@ -1,200 +1,242 @@
 #include "parse.h"
+#include "stats.h"
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
-#include <errno.h>
-
-int handle_sys(char*);
-int handle_jp(char*);
-int handle_reg_jp(char*, char*);
-int handle_call(char*);
-int handle_se(char*, char*);
-int handle_sne(char*, char*);
-int handle_ld(char*, char*);
-int handle_add(char*, char*);
-int handle_or(char*, char*);
-int handle_and(char*, char*);
-int handle_xor(char*, char*);
-int handle_sub(char*, char*);
-int handle_shr(char*, char*);
-int handle_subn(char*, char*);
-int handle_shl(char*, char*);
-int handle_rnd(char*, char*);
-int handle_drw(char*, char*, char*);
-int handle_skp(char*);
-int handle_sknp(char*);
 
+// Operands are lexed once in parse_for_opcode, handlers only look at
+// their kind and value
+typedef struct operand operand;
+
+char* error_token(int, char**, int, operand*);
+int handle_sys(operand*);
+int handle_jp(operand*);
+int handle_reg_jp(operand*, operand*);
+int handle_call(operand*);
+int handle_se(operand*, operand*);
+int handle_sne(operand*, operand*);
+int handle_ld(operand*, operand*);
+int handle_add(operand*, operand*);
+int handle_or(operand*, operand*);
+int handle_and(operand*, operand*);
+int handle_xor(operand*, operand*);
+int handle_sub(operand*, operand*);
+int handle_shr(operand*, operand*);
+int handle_subn(operand*, operand*);
+int handle_shl(operand*, operand*);
+int handle_rnd(operand*, operand*);
+int handle_drw(operand*, operand*, operand*);
+int handle_skp(operand*);
+int handle_sknp(operand*);
+int handle_extension(char*, operand*);
+int handle_ld_extended(operand*, operand*, operand*);
+
+// Instructions of SUPER-CHIP and XO-CHIP live in tables picked by
+// parse_set_target, so plain CHIP-8 never looks at them
+struct mnemonic {
+    const char* name;
+    int opcode;
+    int (*handle)(int, operand*); // NULL when the opcode has no operands
+};
+
+int handle_scroll(int, operand*);
+int handle_reg_range(int, operand*);
+int handle_plane(int, operand*);
+
+static const struct mnemonic schip_mnemonics[] = {
+    {"SCD", 0x00C0, handle_scroll},
+    {"SCR", 0x00FB, NULL},
+    {"SCL", 0x00FC, NULL},
+    {"EXIT", 0x00FD, NULL},
+    {"LOW", 0x00FE, NULL},
+    {"HIGH", 0x00FF, NULL},
+    {NULL, 0, NULL}
+};
+
+static const struct mnemonic xochip_mnemonics[] = {
+    {"SCD", 0x00C0, handle_scroll},
+    {"SCU", 0x00D0, handle_scroll},
+    {"SCR", 0x00FB, NULL},
+    {"SCL", 0x00FC, NULL},
+    {"EXIT", 0x00FD, NULL},
+    {"LOW", 0x00FE, NULL},
+    {"HIGH", 0x00FF, NULL},
+    {"SAVE", 0x5002, handle_reg_range},
+    {"LOAD", 0x5003, handle_reg_range},
+    {"PLANE", 0xF001, handle_plane},
+    {"AUDIO", 0xF002, NULL},
+    {NULL, 0, NULL}
+};
+
+static int target = TARGET_CHIP8;
+static const struct mnemonic* extension_mnemonics = NULL;
+
+char* parse_symbol_ref = NULL;
+int parse_error_column = 0;
+
+int parse_target_from_name(const char* name){
+    if(strcmp(name, "chip8") == 0) return TARGET_CHIP8;
+    if(strcmp(name, "schip") == 0) return TARGET_SCHIP;
+    if(strcmp(name, "xochip") == 0) return TARGET_XOCHIP;
+    return -1;
+}
+
+void parse_set_target(int new_target){
+    target = new_target;
+    switch(target){
+        case TARGET_SCHIP: extension_mnemonics = schip_mnemonics; break;
+        case TARGET_XOCHIP: extension_mnemonics = xochip_mnemonics; break;
+        default: extension_mnemonics = NULL; break;
+    }
+}
+
+int parse_get_target(void){
+    return target;
+}
 
 int parse_for_opcode(char* line){
     // Step 1: Divide string to tokens
     // Step 2: Separate mnemonics (first token in line) from operands (other tokens) 
     // [this step also include removing unneccessary characters, like ',']
-    // Step 3: Switch for mnemonic and find opcode
-    // Step 4: return opcode if no overloading, otherwise pass operands to recognizing functions
-    // Step 5: raise error if unknown opcode is there
+    // Step 3: Lex every operand once
+    // Step 4: Switch for mnemonic and find opcode
+    // Step 5: return opcode if no overloading, otherwise pass operands to recognizing functions
+    // Step 6: raise error if unknown opcode is there
 
     int operand;
+    parse_symbol_ref = NULL;
+    parse_error_column = 0;
 
     // Split string into tokens (also removing ',')
-    char* tokens[MAX_TOKENS];
-    int token_count = 0;
-
-    char* delimiters = " ,\n";
-    char* token = strtok(line, delimiters);
-    while (token != NULL && token_count < MAX_TOKENS) {
-        tokens[token_count++] = token;
-        token = strtok(NULL, delimiters);
-    }
+    STATS_PARSE_START(tokenize);
+    char* tokens[MAX_TOKENS + 1] = {NULL}; // missing operands stay NULL
+    int token_count = lex_tokens(line, tokens, MAX_TOKENS);
 
     if (token_count == 0) return ERR_UNKNOWN_MNEMONIC;
 
+    struct operand ops[3];
+    lex_operand(tokens[1], &ops[0]);
+    lex_operand(tokens[2], &ops[1]);
+    lex_operand(tokens[3], &ops[2]);
+    STATS_PARSE_STOP(STATS_TOKENIZE, tokenize);
+
+    STATS_PARSE_START(dispatch);
+
     if (strcmp(tokens[0], "SYS") == 0) {
-        operand = handle_sys(tokens[1]);
+        operand = handle_sys(&ops[0]);
     } else if (strcmp(tokens[0], "CLS") == 0) {
         operand = 0x00E0;
     } else if (strcmp(tokens[0], "RET") == 0) {
         operand = 0x00EE;
     } else if (strcmp(tokens[0], "JP") == 0) {
-        if(tokens[2] != NULL){
-            operand = handle_reg_jp(tokens[1], tokens[2]);
+        if(ops[1].kind != OPERAND_NONE){
+            operand = handle_reg_jp(&ops[0], &ops[1]);
         } else {
-        operand = handle_jp(tokens[1]);
+        operand = handle_jp(&ops[0]);
         }
     } else if (strcmp(tokens[0], "CALL") == 0) {
-        operand = handle_call(tokens[1]);
+        operand = handle_call(&ops[0]);
     } else if (strcmp(tokens[0], "SE") == 0) {
-        operand = handle_se(tokens[1], tokens[2]);
+        operand = handle_se(&ops[0], &ops[1]);
     } else if (strcmp(tokens[0], "SNE") == 0) {
-        operand = handle_sne(tokens[1], tokens[2]);
+        operand = handle_sne(&ops[0], &ops[1]);
     } else if (strcmp(tokens[0], "LD") == 0) {
-        operand = handle_ld(tokens[1], tokens[2]);
+        if(extension_mnemonics != NULL)
+            operand = handle_ld_extended(&ops[0], &ops[1], &ops[2]);
+        else
+            operand = handle_ld(&ops[0], &ops[1]);
     } else if (strcmp(tokens[0], "ADD") == 0) {
-        operand = handle_add(tokens[1], tokens[2]);
+        operand = handle_add(&ops[0], &ops[1]);
     } else if (strcmp(tokens[0], "OR") == 0) {
-        operand = handle_or(tokens[1], tokens[2]);
+        operand = handle_or(&ops[0], &ops[1]);
     } else if (strcmp(tokens[0], "AND") == 0) {
-        operand = handle_and(tokens[1], tokens[2]);
+        operand = handle_and(&ops[0], &ops[1]);
     } else if (strcmp(tokens[0], "XOR") == 0) {
-        operand = handle_xor(tokens[1], tokens[2]);
+        operand = handle_xor(&ops[0], &ops[1]);
     } else if (strcmp(tokens[0], "SUB") == 0) {
-        operand = handle_sub(tokens[1], tokens[2]);
+        operand = handle_sub(&ops[0], &ops[1]);
     } else if (strcmp(tokens[0], "SHR") == 0) {
-        operand = handle_shr(tokens[1], tokens[2]);
+        operand = handle_shr(&ops[0], &ops[1]);
     } else if (strcmp(tokens[0], "SUBN") == 0) {
-        operand = handle_subn(tokens[1], tokens[2]);
+        operand = handle_subn(&ops[0], &ops[1]);
     } else if (strcmp(tokens[0], "SHL") == 0) {
-        operand = handle_shl(tokens[1], tokens[2]);
+        operand = handle_shl(&ops[0], &ops[1]);
     } else if (strcmp(tokens[0], "RND") == 0) {
-        operand = handle_rnd(tokens[1], tokens[2]);
+        operand = handle_rnd(&ops[0], &ops[1]);
     } else if (strcmp(tokens[0], "DRW") == 0) {
-        operand = handle_drw(tokens[1], tokens[2], tokens[3]);
+        operand = handle_drw(&ops[0], &ops[1], &ops[2]);
     } else if (strcmp(tokens[0], "SKP") == 0) {
-        operand = handle_skp(tokens[1]);
+        operand = handle_skp(&ops[0]);
     } else if (strcmp(tokens[0], "SKNP") == 0) {
-        operand = handle_sknp(tokens[1]);
+        operand = handle_sknp(&ops[0]);
+    } else if (extension_mnemonics != NULL) {
+        operand = handle_extension(tokens[0], ops);
     } else {
-        return ERR_UNKNOWN_MNEMONIC;
+        operand = ERR_UNKNOWN_MNEMONIC;
     }
+    STATS_MNEMONIC(tokens[0], dispatch);
 
+    if(operand < 0){
+        parse_error_column = error_token(operand, tokens, token_count, ops) - line;
+    }
     return operand;
 }
 
-
-int convert_char_to_nnn(char* nnn){
-    char* end;
-    errno = 0; // reset errno
-    
-    // Base 0 allows auto-detection of the number's base (e.g., "255" or "0xFF").
-    long address = strtol(nnn, &end, 0);
-
-    // Check for various conversion errors.
-    // 1. If the string is empty or contains non-numeric characters.
-    // 2. If the conversion resulted in an overflow/underflow (ERANGE).
-    if (end == nnn || *end != '\0' || errno == ERANGE) {
-        return ERR_LARGE_DIGIT; // Error: Not a valid number
-    }
-
-    // Check if the address fits within 12 bits (0x000 to 0xFFF).
-    if (address < 0 || address > 0xFFF) {
-        return ERR_LARGE_DIGIT; // Error: Address is too large for 12 bits
-    }
-
-    return address & 0x0fff; // return just 12 bits
+char* error_token(int error, char** tokens, int token_count, operand* ops){
+    // best guess of the token that caused the error, for the column in diagnostics
+    int count = token_count - 1 < 3 ? token_count - 1 : 3;
+    char* last = tokens[token_count - 1];
+    switch(error){
+        case ERR_UNKNOWN_MNEMONIC:
+            return tokens[0];
+        case ERR_MISSING_OPERAND:
+            return last + strlen(last); // where the operand should be
+        case REG_ERR_UNKNOWN:
+            for(int i = 0; i < count; i++)
+                if(ops[i].kind != OPERAND_REG && ops[i].kind != OPERAND_SPECIAL) return ops[i].text;
+            break;
+        case ERR_LARGE_DIGIT:
+            for(int i = count - 1; i >= 0; i--)
+                if(ops[i].kind != OPERAND_REG && ops[i].kind != OPERAND_SPECIAL) return ops[i].text;
+            break;
+    }
+    return count > 0 ? ops[count - 1].text : tokens[0];
 }
 
-int get_special_reg(char* reg){
-    // for special registers, like I, [I], ST and DT
-    // Step 1: separate registers by length
-    // On length 3 we check only if it's a [I]
-    // On length 2 it could be ST or DT
-    // On length 1 it could be I, K,  F or B (technically, they're not registers, but they used in
-    // chip8 assembly language as special operands)
-    // If no special reg found, return REG_ERR_UNKNOWN
-    size_t length = strlen(reg);
-    if(length == 3){ // It's [I]
-        if(reg[0] == '[' && reg[1] == 'I' && reg[2] == ']')
-            return 0x1; // means [I] special word
-    }
-    else if (length == 2){ // ST or DT
-        if(reg[1] == 'T'){
-            if(reg[0] == 'S') return 0x2; // means ST
-            else if (reg[0] == 'D') return 0x3; // means DT
-        }
-    }
-    else if (length == 1){
-        if(reg[0] == 'I') return 0x4; // means I
-        else if (reg[0] == 'F') return 0x5; // means F
-        else if (reg[0] == 'B') return 0x6; // means B
-        else if (reg[0] == 'K') return 0x7; // means K
-    }
 
-    return REG_ERR_UNKNOWN; // if no register found
+int convert_to_number(operand* op, int range){
+    // value of a number that fits into range, ERR_LARGE_DIGIT otherwise
+    if(op->kind != OPERAND_NUMBER || op->range > range){
+        return ERR_LARGE_DIGIT;
+    }
+    return op->value;
 }
 
-int get_reg_id(char* reg){
-    // reg is in format 'Vx', where x is one of 0-F
-    if(strlen(reg) < 2)
-        return REG_ERR_UNKNOWN;
-    if(reg[0] != 'V')
-            return REG_ERR_UNKNOWN;
-    switch(reg[1]){
-        case '0': return 0;
-        case '1': return 1;
-        case '2': return 2;
-        case '3': return 3;
-        case '4': return 4;
-        case '5': return 5;
-        case '6': return 6;
-        case '7': return 7;
-        case '8': return 8;
-        case '9': return 9;
-        case 'A': return 0xa;
-        case 'B': return 0xb;
-        case 'C': return 0xc;
-        case 'D': return 0xd;
-        case 'E': return 0xe;
-        case 'F': return 0xf;
-        default: 
-            return REG_ERR_UNKNOWN;
+int convert_to_addr(operand* op){
+    // 12 bit address, or a label name. The label is left in parse_symbol_ref
+    // and address 0 is returned, the linker fills in the real one.
+    if(op->kind != OPERAND_NUMBER && op->is_name){
+        parse_symbol_ref = op->text;
+        return 0;
     }
+    return convert_to_number(op, RANGE_ADDR);
 }
 
-int handle_sys(char* nnn){
-    if(nnn == NULL){
+int handle_sys(operand* nnn){
+    if(nnn->kind == OPERAND_NONE){
         return ERR_MISSING_OPERAND; // missing operand error
     }
 
     // The opcode is '0nnn', which is simply the value of the address.
-    return convert_char_to_nnn(nnn);
+    return convert_to_addr(nnn);
 }
 
 
-int handle_jp(char* nnn){
-    if(nnn == NULL){
+int handle_jp(operand* nnn){
+    if(nnn->kind == OPERAND_NONE){
         return ERR_MISSING_OPERAND; // missing operand error
     }
-    // nnn -> int
-    int address = convert_char_to_nnn(nnn);
+    int address = convert_to_addr(nnn);
     if(address == ERR_LARGE_DIGIT){
         return ERR_LARGE_DIGIT;
     }
@@ -203,29 +245,23 @@ int handle_jp(char* nnn){
     
 }
 
-int handle_reg_jp(char* reg, char* nnn){
-    if(reg == NULL || nnn == NULL){
+int handle_reg_jp(operand* reg, operand* nnn){
+    if(reg->kind == OPERAND_NONE || nnn->kind == OPERAND_NONE){
         return ERR_MISSING_OPERAND; // missing operand error
     }
-    // find out register number
-    int reg_id = get_reg_id(reg);
 
     //check for errors
-    if(reg_id == REG_ERR_UNKNOWN){
-        //return REG_ERR_UNKNOWN;
+    if(reg->kind != OPERAND_REG){
         return handle_jp(reg); // BAD!!!
     }
-    else if(reg_id == REG_ERR_MISSING){
-        return REG_ERR_MISSING;
-    }
 
     // in instruction JP V0, addr register number must be 0
-    if(reg_id != 0x0){
+    if(reg->value != 0x0){
         return ERR_MISSING_OPERAND;
     }
 
     // get address
-    int address = convert_char_to_nnn(nnn);
+    int address = convert_to_addr(nnn);
     if(address == ERR_LARGE_DIGIT){
         return ERR_LARGE_DIGIT;
     }
@@ -234,11 +270,11 @@ int handle_reg_jp(char* reg, char* nnn){
     return 0xb000 | address;
 }
 
-int handle_call(char* nnn){
-    if(nnn == NULL){
+int handle_call(operand* nnn){
+    if(nnn->kind == OPERAND_NONE){
         return ERR_MISSING_OPERAND; // missing operand error
     }
-    int address = convert_char_to_nnn(nnn);    
+    int address = convert_to_addr(nnn);
     if(address == ERR_LARGE_DIGIT){
         return ERR_LARGE_DIGIT;
     }
@@ -246,478 +282,304 @@ int handle_call(char* nnn){
     return 0x2000 | address;
 }
 
-int handle_se(char* reg, char* kk){
-    if(reg == NULL || kk == NULL){
+int handle_skip(int byte_opcode, int reg_opcode, operand* reg, operand* kk){
+    // SE and SNE: Vx, byte or Vx, Vy
+    if(reg->kind == OPERAND_NONE || kk->kind == OPERAND_NONE){
         return ERR_MISSING_OPERAND; 
     }
-    // find out register number
-    int reg_id = get_reg_id(reg);
-
-    //check for errors
-    if(reg_id == REG_ERR_UNKNOWN){
+    if(reg->kind != OPERAND_REG){
         return REG_ERR_UNKNOWN;
     }
-    else if(reg_id == REG_ERR_MISSING){
-        return REG_ERR_MISSING;
-    }
 
-    // there are 2 SE: one where both operand are registers, and one where the register is only first
-    int kk_reg = get_reg_id(kk);
-    if(kk_reg == REG_ERR_UNKNOWN){ // so, kk in not a register, it's a byte
-        kk_reg = convert_char_to_nnn(kk);
-        if(kk_reg == ERR_LARGE_DIGIT){
+    if(kk->kind != OPERAND_REG){ // so, kk in not a register, it's a byte
+        int byte = convert_to_number(kk, RANGE_ADDR);
+        if(byte == ERR_LARGE_DIGIT){
             return ERR_LARGE_DIGIT;
         }
-        kk_reg = kk_reg & 0xff; // we need only 1 byte
-
-        // return 3xkk
-        return 0x3000 | (reg_id & 0xf) << 8 | kk_reg;
-
-
-    } else{ // kk is a register
-        
-        if(kk_reg == REG_ERR_MISSING){
-            return REG_ERR_MISSING;
-        }
-
-        // return 5xy0
-        return 0x5000 | (reg_id & 0xf) << 8 | (kk_reg & 0xf) << 4;
+        // return 3xkk / 4xkk, we need only 1 byte
+        return byte_opcode | reg->value << 8 | (byte & 0xff);
     }
 
+    // return 5xy0 / 9xy0
+    return reg_opcode | reg->value << 8 | kk->value << 4;
+}
 
+int handle_se(operand* reg, operand* kk){
+    return handle_skip(0x3000, 0x5000, reg, kk);
 }
 
-int handle_sne(char* reg, char* kk){
-    if(reg == NULL || kk == NULL){
-        return ERR_MISSING_OPERAND; 
-    }
-    // find out register number
-    int reg_id = get_reg_id(reg);
+int handle_sne(operand* reg, operand* kk){
+    return handle_skip(0x4000, 0x9000, reg, kk);
+}
 
-    //check for errors
-    if(reg_id == REG_ERR_UNKNOWN){
-        return REG_ERR_UNKNOWN;
-    }
-    else if(reg_id == REG_ERR_MISSING){
-        return REG_ERR_MISSING;
+int handle_ld(operand* x, operand* y){
+    if(x->kind == OPERAND_NONE || y->kind == OPERAND_NONE){
+        return ERR_MISSING_OPERAND; 
     }
 
-    // there are 2 SE: one where both operand are registers, and one where the register is only first
-    int kk_reg = get_reg_id(kk);
-    if(kk_reg == REG_ERR_UNKNOWN){ // so, kk in not a register, it's a byte
-        kk_reg = convert_char_to_nnn(kk);
-        if(kk_reg == ERR_LARGE_DIGIT){
-            return ERR_LARGE_DIGIT;
+    if(x->kind == OPERAND_SPECIAL){
+        if(x->value == SPECIAL_I){ // x is I, so y must be addr
+            int address = convert_to_addr(y);
+            if(address == ERR_LARGE_DIGIT){
+                return ERR_LARGE_DIGIT;
+            }
+            // return 0xannn
+            return 0xa000 | address;
         }
-        kk_reg = kk_reg & 0xff; // we need only 1 byte
-
-        // return 4xkk
-        return 0x4000 | (reg_id & 0xf) << 8 | kk_reg;
-
-
-    } else{ // kk is a register
-        
-        if(kk_reg == REG_ERR_MISSING){
-            return REG_ERR_MISSING;
+        if(x->value == SPECIAL_K){
+            return ERR_INVALID_OPERAND;
         }
 
-        // return 9xy0
-        return 0x9000 | (reg_id & 0xf) << 8 | (kk_reg & 0xf) << 4;
+        // DT, ST, F, B and [I] take a regular register
+        if(y->kind != OPERAND_REG){
+            return ERR_INVALID_OPERAND;
+        }
+        switch(x->value){
+            case SPECIAL_DT: return 0xf015 | y->value << 8; // return 0xfx15
+            case SPECIAL_ST: return 0xf018 | y->value << 8; // return 0xfx18
+            case SPECIAL_F: return 0xf029 | y->value << 8; // return 0xfx29
+            case SPECIAL_B: return 0xf033 | y->value << 8; // return 0xfx33
+            default: return 0xf055 | y->value << 8; // [I], return 0xfx55
+        }
     }
 
-
-}
-
-int handle_ld(char* x, char* y){
-    if(x == NULL || y == NULL){
-        return ERR_MISSING_OPERAND; 
+    if(x->kind != OPERAND_REG){
+        return REG_ERR_UNKNOWN;
     }
-    // check if x is a regular register
-    int x_id = get_reg_id(x);
-    int y_id;
-
-    if(x_id == REG_ERR_UNKNOWN){
-        // so, x  is not a regular reguster, it's special
-        x_id = get_special_reg(x);
-        if(x_id == REG_ERR_UNKNOWN){
-            return REG_ERR_UNKNOWN;
-        }
-        switch(x_id){
-            case 0x4: // x is I, so y must be addr
-                y_id = convert_char_to_nnn(y);
-                if(y_id == ERR_LARGE_DIGIT){
-                    return ERR_LARGE_DIGIT;
-                }
-                // return 0xannn
-                return 0xa000 | y_id;
-            case 0x3: // x is DT, so y must be regular register
-                y_id = get_reg_id(y);
-                if(y_id == REG_ERR_MISSING){
-                    return REG_ERR_MISSING;
-                } else if(y_id == REG_ERR_UNKNOWN){
-                    return ERR_INVALID_OPERAND;
-                } else {
-                    // return 0xfx15
-                    return 0xf015 | (y_id & 0xf) << 8;
-                }
-            case 0x2: // x is ST, so y must be regular register
-                y_id = get_reg_id(y);
-                if(y_id == REG_ERR_MISSING){
-                    return REG_ERR_MISSING;
-                } else if(y_id == REG_ERR_UNKNOWN){
-                    return ERR_INVALID_OPERAND;
-                } else {
-                    // return 0xfx18
-                    return 0xf018 | (y_id & 0xf) << 8;
-                }
-            case 0x5: // x is F, so y must be regular register
-                y_id = get_reg_id(y);
-                if(y_id == REG_ERR_MISSING){
-                    return REG_ERR_MISSING;
-                } else if(y_id == REG_ERR_UNKNOWN){
-                    return ERR_INVALID_OPERAND;
-                } else {
-                    // return 0xfx29
-                    return 0xf029 | (y_id & 0xf) << 8;
-                }
-            case 0x6: // x is B
-                y_id = get_reg_id(y);
-                if(y_id == REG_ERR_MISSING){
-                    return REG_ERR_MISSING;
-                } else if(y_id == REG_ERR_UNKNOWN){
-                    return ERR_INVALID_OPERAND;
-                } else {
-                    // return 0xfx33
-                    return 0xf033 | (y_id & 0xf) << 8;
-                }
-            case 0x1: // x is [I]
-                y_id = get_reg_id(y);
-                if(y_id == REG_ERR_MISSING){
-                    return REG_ERR_MISSING;
-                } else if(y_id == REG_ERR_UNKNOWN){
-                    return ERR_INVALID_OPERAND;
-                } else {
-                    // return 0xfx55
-                    return 0xf055 | (y_id & 0xf) << 8;
-                }
-            default:
-                return ERR_INVALID_OPERAND;
 
-        }
-    } else{
-        // x is a regular register
-        // check second operand y
-        y_id = get_reg_id(y);
-        if(y_id == REG_ERR_MISSING)
-            return REG_ERR_MISSING;
-        if(y_id == REG_ERR_UNKNOWN){
-            // so, y is byte or special operand
-            y_id = get_special_reg(y);
-            if(y_id == REG_ERR_UNKNOWN){ // so, y is byte
-                y_id = convert_char_to_nnn(y);
-                if(y_id == ERR_LARGE_DIGIT)
-                    return ERR_LARGE_DIGIT;
-                if(y_id > 0xff)
-                    return ERR_LARGE_DIGIT;
-                // return 0x6xkk
-                return 0x6000 | (x_id & 0xf) << 8 | y_id;
-            } else{
-                if(y_id == 0x1){ // second operand is [I]
-                    // return 0xfx65
-                    return 0xf065 | (x_id & 0xf) << 8;
-                } else if(y_id == 0x3){ // second operand is DT
-                    // return 0xfx07
-                    return 0xf007 | (x_id & 0xf) << 8;
-                } else if (y_id == 0x7){ // second operand is K
-                    // return 0xfx0a
-                    return 0xf00a | (x_id & 0xf) << 8;
-                } else {
-                    return ERR_INVALID_OPERAND; // wrong special register
-                }
-            }
-        } else{
+    // x is a regular register
+    switch(y->kind){
+        case OPERAND_REG:
             // return LD Vx, Vy, 0x8xy0
-            return 0x8000 | (x_id & 0xf) << 8 | (y_id & 0xf) << 4; 
+            return 0x8000 | x->value << 8 | y->value << 4;
+        case OPERAND_SPECIAL:
+            if(y->value == SPECIAL_I_MEM) return 0xf065 | x->value << 8; // return 0xfx65
+            if(y->value == SPECIAL_DT) return 0xf007 | x->value << 8; // return 0xfx07
+            if(y->value == SPECIAL_K) return 0xf00a | x->value << 8; // return 0xfx0a
+            return ERR_INVALID_OPERAND; // wrong special register
+        default: {
+            // y is byte
+            int byte = convert_to_number(y, RANGE_BYTE);
+            if(byte == ERR_LARGE_DIGIT){
+                return ERR_LARGE_DIGIT;
+            }
+            // return 0x6xkk
+            return 0x6000 | x->value << 8 | byte;
         }
     }
 }
 
-int handle_add(char* x, char* y){
-    if(x == NULL || y == NULL){
+int handle_add(operand* x, operand* y){
+    if(x->kind == OPERAND_NONE || y->kind == OPERAND_NONE){
         return ERR_MISSING_OPERAND; 
     }
-    // check if x is a regular register
-    int x_id = get_reg_id(x);
-    if(x_id == REG_ERR_MISSING){
-        return REG_ERR_MISSING;
-    }
-    if(x_id == REG_ERR_UNKNOWN){
+    if(x->kind != OPERAND_REG){
         return REG_ERR_UNKNOWN;
     }
-    int y_id = get_reg_id(y);
-    if(y_id == REG_ERR_MISSING){
-        return REG_ERR_MISSING;
-    }
-    if(y_id == REG_ERR_UNKNOWN){ // y is byte
-        y_id = convert_char_to_nnn(y);
-        if(y_id == ERR_LARGE_DIGIT || y_id > 0xff)
+    if(y->kind != OPERAND_REG){ // y is byte
+        int byte = convert_to_number(y, RANGE_BYTE);
+        if(byte == ERR_LARGE_DIGIT){
             return ERR_LARGE_DIGIT;
-        return 0x7000 | (x_id & 0xf) << 8 | y_id;
+        }
+        return 0x7000 | x->value << 8 | byte;
     }
 
-    return 0x8004 | (x_id & 0xf) << 8 | (y_id & 0xf) << 4;
-
+    return 0x8004 | x->value << 8 | y->value << 4;
 }
 
-int handle_or(char* x, char* y){
-    if(x == NULL || y == NULL){
+int handle_alu(int opcode, operand* x, operand* y){
+    // 8xyN instructions, both operands are registers
+    if(x->kind == OPERAND_NONE || y->kind == OPERAND_NONE){
         return ERR_MISSING_OPERAND; 
     }
-    // check if x is a regular register
-    int x_id = get_reg_id(x);
-    if(x_id == REG_ERR_MISSING){
-        return REG_ERR_MISSING;
-    }
-    if(x_id == REG_ERR_UNKNOWN){
-        return REG_ERR_UNKNOWN;
-    }
-    int y_id = get_reg_id(y);
-    if(y_id == REG_ERR_MISSING){
-        return REG_ERR_MISSING;
-    }
-    if(y_id == REG_ERR_UNKNOWN){
+    if(x->kind != OPERAND_REG || y->kind != OPERAND_REG){
         return REG_ERR_UNKNOWN;
     }
+    return opcode | x->value << 8 | y->value << 4;
+}
 
-    return 0x8001 | (x_id & 0xf) << 8 | (y_id & 0xf) << 4;
+int handle_or(operand* x, operand* y){
+    return handle_alu(0x8001, x, y);
 }
 
-int handle_and(char* x, char* y){
-    if(x == NULL || y == NULL){
-        return ERR_MISSING_OPERAND; 
-    }
-    // check if x is a regular register
-    int x_id = get_reg_id(x);
-    if(x_id == REG_ERR_MISSING){
-        return REG_ERR_MISSING;
-    }
-    if(x_id == REG_ERR_UNKNOWN){
-        return REG_ERR_UNKNOWN;
-    }
-    int y_id = get_reg_id(y);
-    if(y_id == REG_ERR_MISSING){
-        return REG_ERR_MISSING;
-    }
-    if(y_id == REG_ERR_UNKNOWN){
-        return REG_ERR_UNKNOWN;
-    }
+int handle_and(operand* x, operand* y){
+    return handle_alu(0x8002, x, y);
+}
 
-    return 0x8002 | (x_id & 0xf) << 8 | (y_id & 0xf) << 4;
+int handle_xor(operand* x, operand* y){
+    return handle_alu(0x8003, x, y);
 }
 
-int handle_xor(char* x, char* y){
-    if(x == NULL || y == NULL){
-        return ERR_MISSING_OPERAND; 
-    }
-    // check if x is a regular register
-    int x_id = get_reg_id(x);
-    if(x_id == REG_ERR_MISSING){
-        return REG_ERR_MISSING;
-    }
-    if(x_id == REG_ERR_UNKNOWN){
-        return REG_ERR_UNKNOWN;
-    }
-    int y_id = get_reg_id(y);
-    if(y_id == REG_ERR_MISSING){
-        return REG_ERR_MISSING;
-    }
-    if(y_id == REG_ERR_UNKNOWN){
-        return REG_ERR_UNKNOWN;
-    }
+int handle_sub(operand* x, operand* y){
+    return handle_alu(0x8005, x, y);
+}
 
-    return 0x8003 | (x_id & 0xf) << 8 | (y_id & 0xf) << 4;
+int handle_shr(operand* x, operand* y){
+    return handle_alu(0x8006, x, y);
 }
 
-int handle_sub(char* x, char* y){
-    if(x == NULL || y == NULL){
-        return ERR_MISSING_OPERAND; 
-    }
-    // check if x is a regular register
-    int x_id = get_reg_id(x);
-    if(x_id == REG_ERR_MISSING){
-        return REG_ERR_MISSING;
-    }
-    if(x_id == REG_ERR_UNKNOWN){
-        return REG_ERR_UNKNOWN;
-    }
-    int y_id = get_reg_id(y);
-    if(y_id == REG_ERR_MISSING){
-        return REG_ERR_MISSING;
-    }
-    if(y_id == REG_ERR_UNKNOWN){
-        return REG_ERR_UNKNOWN;
-    }
+int handle_subn(operand* x, operand* y){
+    return handle_alu(0x8007, x, y);
+}
 
-    return 0x8005 | (x_id & 0xf) << 8 | (y_id & 0xf) << 4;
+int handle_shl(operand* x, operand* y){
+    return handle_alu(0x800e, x, y);
 }
 
-int handle_shr(char* x, char* y){
-    if(x == NULL || y == NULL){
+int handle_rnd(operand* x, operand* y){
+    if(x->kind == OPERAND_NONE || y->kind == OPERAND_NONE){
         return ERR_MISSING_OPERAND; 
     }
-    // check if x is a regular register
-    int x_id = get_reg_id(x);
-    if(x_id == REG_ERR_MISSING){
-        return REG_ERR_MISSING;
-    }
-    if(x_id == REG_ERR_UNKNOWN){
+    if(x->kind != OPERAND_REG){
         return REG_ERR_UNKNOWN;
     }
-    int y_id = get_reg_id(y);
-    if(y_id == REG_ERR_MISSING){
-        return REG_ERR_MISSING;
-    }
-    if(y_id == REG_ERR_UNKNOWN){
-        return REG_ERR_UNKNOWN;
+    int byte = convert_to_number(y, RANGE_BYTE);
+    if(byte == ERR_LARGE_DIGIT){
+        return ERR_LARGE_DIGIT;
     }
 
-    return 0x8006 | (x_id & 0xf) << 8 | (y_id & 0xf) << 4;
+    return 0xc000 | x->value << 8 | byte;
 }
 
-int handle_subn(char* x, char* y){
-    if(x == NULL || y == NULL){
+int handle_drw(operand* x, operand* y, operand* n){
+    if(x->kind == OPERAND_NONE || y->kind == OPERAND_NONE || n->kind == OPERAND_NONE){
         return ERR_MISSING_OPERAND; 
     }
-    // check if x is a regular register
-    int x_id = get_reg_id(x);
-    if(x_id == REG_ERR_MISSING){
-        return REG_ERR_MISSING;
-    }
-    if(x_id == REG_ERR_UNKNOWN){
+    if(x->kind != OPERAND_REG || y->kind != OPERAND_REG){
         return REG_ERR_UNKNOWN;
     }
-    int y_id = get_reg_id(y);
-    if(y_id == REG_ERR_MISSING){
-        return REG_ERR_MISSING;
-    }
-    if(y_id == REG_ERR_UNKNOWN){
-        return REG_ERR_UNKNOWN;
+    int rows = convert_to_number(n, RANGE_NIBBLE);
+    if(rows == ERR_LARGE_DIGIT){
+        return ERR_LARGE_DIGIT;
     }
 
-    return 0x8007 | (x_id & 0xf) << 8 | (y_id & 0xf) << 4;
+    return 0xd000 | x->value << 8 | y->value << 4 | rows;
 }
 
-int handle_shl(char* x, char* y){
-    if(x == NULL || y == NULL){
+int handle_skp(operand* x){
+    if(x->kind == OPERAND_NONE){
         return ERR_MISSING_OPERAND; 
     }
-    // check if x is a regular register
-    int x_id = get_reg_id(x);
-    if(x_id == REG_ERR_MISSING){
-        return REG_ERR_MISSING;
-    }
-    if(x_id == REG_ERR_UNKNOWN){
-        return REG_ERR_UNKNOWN;
-    }
-    int y_id = get_reg_id(y);
-    if(y_id == REG_ERR_MISSING){
-        return REG_ERR_MISSING;
-    }
-    if(y_id == REG_ERR_UNKNOWN){
+    if(x->kind != OPERAND_REG){
         return REG_ERR_UNKNOWN;
     }
-
-    return 0x800e | (x_id & 0xf) << 8 | (y_id & 0xf) << 4;
+    return 0xe09e | x->value << 8;
 }
 
-int handle_rnd(char* x, char* y){
-    if(x == NULL || y == NULL){
+int handle_sknp(operand* x){
+    if(x->kind == OPERAND_NONE){
         return ERR_MISSING_OPERAND; 
     }
-    // check if x is a regular register
-    int x_id = get_reg_id(x);
-    if(x_id == REG_ERR_MISSING){
-        return REG_ERR_MISSING;
-    }
-    if(x_id == REG_ERR_UNKNOWN){
+    if(x->kind != OPERAND_REG){
         return REG_ERR_UNKNOWN;
     }
-    int y_id = convert_char_to_nnn(y);
-    if(y_id == ERR_LARGE_DIGIT || y_id > 0xff){
-        return ERR_LARGE_DIGIT;
-    }
-
-    return 0xc000 | (x_id & 0xf) << 8 | y_id;
+    return 0xe0a1 | x->value << 8;
 }
 
-int handle_drw(char* x, char* y, char* n){
-    if(x == NULL || y == NULL || n == NULL){
-        return ERR_MISSING_OPERAND; 
-    }
-    // check if x is a regular register
-    int x_id = get_reg_id(x);
-    if(x_id == REG_ERR_MISSING){
-        return REG_ERR_MISSING;
-    }
-    if(x_id == REG_ERR_UNKNOWN){
-        return REG_ERR_UNKNOWN;
-    }
-    int y_id = get_reg_id(y);
-    if(y_id == REG_ERR_MISSING){
-        return REG_ERR_MISSING;
-    }
-    if(y_id == REG_ERR_UNKNOWN){
-        return REG_ERR_UNKNOWN;
+int handle_extension(char* mnemonic, operand* operands){
+    for(const struct mnemonic* m = extension_mnemonics; m->name != NULL; m++){
+        if(strcmp(mnemonic, m->name) == 0){
+            if(m->handle == NULL) return m->opcode;
+            return m->handle(m->opcode, operands);
+        }
     }
+    return ERR_UNKNOWN_MNEMONIC;
+}
 
-    int n_id = convert_char_to_nnn(n);
-    if(n_id == ERR_LARGE_DIGIT || n_id > 0xf){
+int handle_scroll(int opcode, operand* operands){
+    // SCD n / SCU n, scroll by 0-15 lines
+    if(operands[0].kind == OPERAND_NONE){
+        return ERR_MISSING_OPERAND;
+    }
+    int n = convert_to_number(&operands[0], RANGE_NIBBLE);
+    if(n == ERR_LARGE_DIGIT){
         return ERR_LARGE_DIGIT;
     }
-
-    return 0xd000 | (x_id & 0xf) << 8 | (y_id & 0xf) << 4 | n_id;
+    return opcode | n;
 }
 
-int handle_skp(char* x){
-    if(x == NULL){
-        return ERR_MISSING_OPERAND; 
-    }
-    // check if x is a regular register
-    int x_id = get_reg_id(x);
-    if(x_id == REG_ERR_MISSING){
-        return REG_ERR_MISSING;
+int handle_reg_range(int opcode, operand* operands){
+    // SAVE Vx, Vy / LOAD Vx, Vy, 5xy2 and 5xy3
+    if(operands[0].kind == OPERAND_NONE || operands[1].kind == OPERAND_NONE){
+        return ERR_MISSING_OPERAND;
     }
-    if(x_id == REG_ERR_UNKNOWN){
+    if(operands[0].kind != OPERAND_REG || operands[1].kind != OPERAND_REG){
         return REG_ERR_UNKNOWN;
     }
-    return 0xe09e | (x_id & 0xf) << 8;
+    return opcode | operands[0].value << 8 | operands[1].value << 4;
 }
 
-int handle_sknp(char* x){
-    if(x == NULL){
-        return ERR_MISSING_OPERAND; 
-    }
-    // check if x is a regular register
-    int x_id = get_reg_id(x);
-    if(x_id == REG_ERR_MISSING){
-        return REG_ERR_MISSING;
+int handle_plane(int opcode, operand* operands){
+    // PLANE n, Fn01, n is a mask of the two drawing planes
+    if(operands[0].kind == OPERAND_NONE){
+        return ERR_MISSING_OPERAND;
     }
-    if(x_id == REG_ERR_UNKNOWN){
-        return REG_ERR_UNKNOWN;
+    int n = convert_to_number(&operands[0], RANGE_NIBBLE);
+    if(n == ERR_LARGE_DIGIT || n > 0x3){
+        return ERR_LARGE_DIGIT;
     }
-    return 0xe0a1 | (x_id & 0xf) << 8;
+    return opcode | n << 8;
 }
 
+int handle_ld_extended(operand* x, operand* y, operand* z){
+    // LD forms added by SUPER-CHIP and XO-CHIP, the rest goes to handle_ld
+    if(x->kind == OPERAND_NONE || y->kind == OPERAND_NONE){
+        return ERR_MISSING_OPERAND;
+    }
 
+    if(x->kind == OPERAND_SYMBOL && (strcmp(x->text, "HF") == 0 || strcmp(x->text, "R") == 0 ||
+       (target == TARGET_XOCHIP && strcmp(x->text, "PITCH") == 0))){
+        if(y->kind != OPERAND_REG){
+            return ERR_INVALID_OPERAND;
+        }
+        if(x->text[0] == 'H'){
+            // return 0xfx30
+            return 0xf030 | y->value << 8;
+        }
+        if(x->text[0] == 'P'){
+            // return 0xfx3a
+            return 0xf03a | y->value << 8;
+        }
+        // SUPER-CHIP has 8 flag registers, XO-CHIP 16
+        if(target == TARGET_SCHIP && y->value > 7){
+            return REG_ERR_UNKNOWN;
+        }
+        // return 0xfx75
+        return 0xf075 | y->value << 8;
+    }
 
+    if(x->kind == OPERAND_REG && y->kind == OPERAND_SYMBOL && strcmp(y->text, "R") == 0){
+        if(target == TARGET_SCHIP && x->value > 7){
+            return REG_ERR_UNKNOWN;
+        }
+        // return 0xfx85
+        return 0xf085 | x->value << 8;
+    }
 
+    if(target == TARGET_XOCHIP && x->kind == OPERAND_SPECIAL && x->value == SPECIAL_I){
+        // 'LD I, LONG nnnn'. Labels always take the long form, where they end
+        // up is only known after linking
+        operand* nnnn = y;
+        if(y->kind == OPERAND_SYMBOL && strcmp(y->text, "LONG") == 0){
+            if(z->kind == OPERAND_NONE){
+                return ERR_MISSING_OPERAND;
+            }
+            nnnn = z;
+        }
+        if(nnnn->kind != OPERAND_NUMBER && nnnn->is_name){
+            parse_symbol_ref = nnnn->text;
+            return OPCODE_LONG;
+        }
+        int address = convert_to_number(nnnn, RANGE_WORD);
+        if(address == ERR_LARGE_DIGIT){
+            return ERR_LARGE_DIGIT;
+        }
+        if(nnnn == y && address <= 0xFFF){
+            // return 0xannn
+            return 0xa000 | address;
+        }
+        return OPCODE_LONG | address;
+    }
 
-
-
-
-
-
-
-
-
-
+    return handle_ld(x, y);
+}
@@ -1,5 +1,7 @@
 #pragma once
 
+#include "lex.h"
+
 #define MAX_TOKENS 8
 #define REG_ERR_UNKNOWN -5
 #define REG_ERR_MISSING -4
@@ -8,4 +10,19 @@
 #define ERR_MISSING_OPERAND -3
 #define ERR_INVALID_OPERAND -6
 
+#define TARGET_CHIP8 0
+#define TARGET_SCHIP 1 // SUPER-CHIP 1.1
+#define TARGET_XOCHIP 2
+
+// XO-CHIP 'F000 NNNN' takes 4 bytes, the low 16 bits of the result are NNNN
+#define OPCODE_LONG 0x10000
+
+// label named by the address operand of the last parsed line, NULL if none
+extern char* parse_symbol_ref;
+// offset in the parsed line of the token an error is about
+extern int parse_error_column;
+
+int parse_target_from_name(const char*);
+void parse_set_target(int);
+int parse_get_target(void);
 int parse_for_opcode(char*);
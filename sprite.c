@@ -0,0 +1,215 @@
+#include "sprite.h"
+#include "diag.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The image is read in one go and turned into a packed bitmap, one bit per
+// pixel. P4 rows are packed already and are copied as they are, gray images
+// are thresholded a row at a time and packed 8 pixels a byte.
+
+static int is_space(uint8_t c){
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
+
+static const uint8_t* skip_space(const uint8_t* p, const uint8_t* end){
+    // whitespace and '#' comments
+    while(p < end){
+        if(*p == '#'){
+            while(p < end && *p != '\n') p++;
+        } else if(is_space(*p)){
+            p++;
+        } else {
+            break;
+        }
+    }
+    return p;
+}
+
+static const uint8_t* read_int(const uint8_t* p, const uint8_t* end, int* value){
+    // NULL if there is no number or it's bigger than 16 bits
+    p = skip_space(p, end);
+    if(p == end || *p < '0' || *p > '9') return NULL;
+    int v = 0;
+    while(p < end && *p >= '0' && *p <= '9'){
+        v = v * 10 + (*p++ - '0');
+        if(v > 0xffff) return NULL;
+    }
+    *value = v;
+    return p;
+}
+
+static void pack_row(const uint8_t* lit, int width, uint8_t* out){
+    // lit holds 0 or 1 per pixel. Whole bytes have no branches in the loop,
+    // so the compiler can vectorize it
+    int x = 0;
+    for(; x + 8 <= width; x += 8){
+        out[x >> 3] = lit[x] << 7 | lit[x + 1] << 6 | lit[x + 2] << 5 | lit[x + 3] << 4 |
+                      lit[x + 4] << 3 | lit[x + 5] << 2 | lit[x + 6] << 1 | lit[x + 7];
+    }
+    if(x < width){
+        uint8_t byte = 0;
+        for(int i = 0; x + i < width; i++)
+            byte |= lit[x + i] << (7 - i);
+        out[x >> 3] = byte;
+    }
+}
+
+static uint8_t* read_whole_file(const char* path, size_t* size){
+    FILE* fp = fopen(path, "rb");
+    if(fp == NULL) return NULL;
+    fseek(fp, 0, SEEK_END);
+    long length = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    uint8_t* data = malloc(length > 0 ? length : 1);
+    if(data == NULL){
+        printf("Error: out of memory\n");
+        exit(1);
+    }
+    *size = length > 0 ? fread(data, 1, length, fp) : 0;
+    fclose(fp);
+    return data;
+}
+
+static int decode(const uint8_t* p, const uint8_t* end, int threshold, struct bitmap* bm){
+    if(end - p < 2 || p[0] != 'P' || p[1] < '1' || p[1] > '5' || p[1] == '3')
+        return ERR_IMAGE_FORMAT;
+    int format = p[1] - '0';
+    p += 2;
+
+    int maxval = 1;
+    p = read_int(p, end, &bm->width);
+    if(p != NULL) p = read_int(p, end, &bm->height);
+    if(p != NULL && (format == 2 || format == 5)) p = read_int(p, end, &maxval);
+    if(p == NULL || maxval == 0) return ERR_IMAGE_FORMAT;
+    if(bm->width == 0 || bm->height == 0 || bm->width > SPRITE_MAX_SIZE || bm->height > SPRITE_MAX_SIZE)
+        return ERR_IMAGE_SIZE;
+
+    bm->stride = (bm->width + 7) / 8;
+    bm->bits = calloc(bm->stride * bm->height, 1);
+    uint8_t* lit = malloc(bm->width);
+    if(bm->bits == NULL || lit == NULL){
+        printf("Error: out of memory\n");
+        exit(1);
+    }
+
+    // gray v is lit when v/maxval < threshold/255
+    uint32_t limit = (uint32_t)threshold * maxval;
+    int result = 0;
+
+    if(format == 4 || format == 5){
+        if(p < end) p++; // one whitespace ends the header
+        int sample = format == 5 && maxval > 0xff ? 2 : 1;
+        size_t row_size = format == 4 ? (size_t)bm->stride : (size_t)bm->width * sample;
+        if((size_t)(end - p) < row_size * bm->height){
+            result = ERR_IMAGE_FORMAT;
+        } else if(format == 4){
+            // trailing bits of a row are padding
+            uint8_t mask = 0xff << ((8 - bm->width % 8) % 8);
+            for(int y = 0; y < bm->height; y++, p += row_size){
+                memcpy(bm->bits + y * bm->stride, p, row_size);
+                bm->bits[y * bm->stride + bm->stride - 1] &= mask;
+            }
+        } else {
+            for(int y = 0; y < bm->height; y++, p += row_size){
+                if(sample == 1){
+                    for(int x = 0; x < bm->width; x++)
+                        lit[x] = p[x] * 255u < limit;
+                } else {
+                    for(int x = 0; x < bm->width; x++)
+                        lit[x] = (uint32_t)(p[2 * x] << 8 | p[2 * x + 1]) * 255u < limit;
+                }
+                pack_row(lit, bm->width, bm->bits + y * bm->stride);
+            }
+        }
+    } else {
+        // plain formats, PBM pixels don't need spaces between them
+        for(int y = 0; y < bm->height && result == 0; y++){
+            for(int x = 0; x < bm->width; x++){
+                int v;
+                if(format == 1){
+                    p = skip_space(p, end);
+                    if(p == end || (*p != '0' && *p != '1')){
+                        result = ERR_IMAGE_FORMAT;
+                        break;
+                    }
+                    lit[x] = *p++ == '1';
+                } else {
+                    p = read_int(p, end, &v);
+                    if(p == NULL || v > maxval){
+                        result = ERR_IMAGE_FORMAT;
+                        break;
+                    }
+                    lit[x] = v * 255u < limit;
+                }
+            }
+            pack_row(lit, bm->width, bm->bits + y * bm->stride);
+        }
+    }
+
+    free(lit);
+    if(result != 0) bitmap_free(bm);
+    return result;
+}
+
+int bitmap_read(const char* path, int threshold, struct bitmap* bm){
+    memset(bm, 0, sizeof(*bm));
+    size_t size;
+    uint8_t* data = read_whole_file(path, &size);
+    if(data == NULL) return ERR_IMAGE_OPEN;
+    int result = decode(data, data + size, threshold, bm);
+    free(data);
+    return result;
+}
+
+void bitmap_free(struct bitmap* bm){
+    free(bm->bits);
+    memset(bm, 0, sizeof(*bm));
+}
+
+int sprite_include(struct object* obj, const char* path, const char* label, int threshold, int rows, int linenumber){
+    struct bitmap bm;
+    int error = bitmap_read(path, threshold, &bm);
+    if(error != 0){
+        char where[32] = "";
+        if(linenumber > 0) snprintf(where, sizeof(where), " on line %d", linenumber);
+        if(error == ERR_IMAGE_OPEN)
+            diag_error(DIAG_IMAGE_OPEN, linenumber, 0, "can't open image '%s'%s", path, where);
+        else if(error == ERR_IMAGE_FORMAT)
+            diag_error(DIAG_IMAGE_FORMAT, linenumber, 0, "'%s' is not a PBM or PGM image%s", path, where);
+        else
+            diag_error(DIAG_IMAGE_SIZE, linenumber, 0, "image '%s' is empty or larger than %dx%d%s",
+                       path, SPRITE_MAX_SIZE, SPRITE_MAX_SIZE, where);
+        return 10;
+    }
+
+    int row_bytes = rows == SPRITE_BIG ? 2 : 1;
+    if(rows == 0) rows = bm.height < SPRITE_MAX_ROWS ? bm.height : SPRITE_MAX_ROWS;
+    int across = (bm.stride + row_bytes - 1) / row_bytes;
+    int down = (bm.height + rows - 1) / rows;
+
+    int result = 0;
+    for(int ty = 0; ty < down; ty++){
+        for(int tx = 0; tx < across; tx++){
+            if(label != NULL){
+                char name[256];
+                snprintf(name, sizeof(name), "%s.%d", label, ty * across + tx);
+                if(obj_define_symbol(obj, name, obj->size) == ERR_DUPLICATE_SYMBOL){
+                    diag_error(DIAG_DUPLICATE_LABEL, linenumber, 0, "label defined twice on line %d '%s'", linenumber, name);
+                    result = 7;
+                }
+            }
+            // rows and columns past the image are blank
+            for(int r = 0; r < rows; r++){
+                int y = ty * rows + r;
+                for(int b = 0; b < row_bytes; b++){
+                    int x = tx * row_bytes + b;
+                    obj_emit_byte(obj, y < bm.height && x < bm.stride ? bm.bits[y * bm.stride + x] : 0);
+                }
+            }
+        }
+    }
+
+    bitmap_free(&bm);
+    return result;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdint.h>
+#include "object.h"
+
+// Sprites from netpbm images: PBM (P1, P4) and PGM (P2, P5).
+// Black in PBM and gray levels darker than the threshold in PGM are lit pixels.
+// An image is cut into sprites 8 pixels wide and 'rows' high, left to right
+// and top to bottom. rows 16 makes 16x16 SUPER-CHIP sprites instead.
+
+#define SPRITE_THRESHOLD 128 // out of 255
+#define SPRITE_MAX_ROWS 15 // DRW Vx, Vy, n takes up to 15 rows
+#define SPRITE_BIG 16
+#define SPRITE_MAX_SIZE 4096 // width or height of an image, memory is smaller anyway
+
+#define ERR_IMAGE_OPEN -12
+#define ERR_IMAGE_FORMAT -13
+#define ERR_IMAGE_SIZE -14
+
+struct bitmap {
+    int width, height;
+    int stride; // bytes per row
+    uint8_t* bits; // 1 is a lit pixel, the leftmost one is the high bit
+};
+
+int bitmap_read(const char* path, int threshold, struct bitmap*);
+void bitmap_free(struct bitmap*);
+
+// Appends the sprites of the image to obj. With a label, every sprite also gets
+// 'label.N'. rows 0 picks the image height, up to SPRITE_MAX_ROWS.
+// Errors are reported for linenumber, returns exit status or 0.
+int sprite_include(struct object*, const char* path, const char* label, int threshold, int rows, int linenumber);
@@ -0,0 +1,165 @@
+#include "stats.h"
+
+#ifndef NO_STATS
+
+#include "object.h"
+#include "lex.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/resource.h>
+
+#define MNEMONIC_SLOTS 64 // a power of two, every mnemonic of all targets fits
+
+struct mnemonic_stats {
+    char name[16]; // empty slot when name[0] is '\0'
+    uint64_t count;
+    uint64_t ns;
+};
+
+int stats_on = 0;
+int stats_encoding = 0;
+static int stats_json;
+static struct timespec stats_start;
+
+static uint64_t phase_ns[STATS_PHASES];
+static struct mnemonic_stats mnemonics[MNEMONIC_SLOTS];
+static uint64_t other_count, other_ns; // names that are too long or don't fit
+
+static uint64_t lines[3];
+static uint64_t files, bytes_in, bytes_out;
+static size_t largest_program, program_limit;
+
+static uint64_t since(const struct timespec* start){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000000ULL + now.tv_nsec - start->tv_nsec;
+}
+
+void stats_enable(int json){
+    stats_on = 1;
+    stats_json = json;
+    clock_gettime(CLOCK_MONOTONIC, &stats_start);
+}
+
+void stats_time(int phase, const struct timespec* start){
+    phase_ns[phase] += since(start);
+}
+
+void stats_mnemonic(const char* name, const struct timespec* start){
+    uint64_t ns = since(start);
+    phase_ns[STATS_PARSE] += ns;
+
+    // names go into JSON as they are, so anything odd is just counted
+    if(strlen(name) < sizeof(mnemonics[0].name) && is_symbol_name(name)){
+        uint32_t slot = hash_string(name) & (MNEMONIC_SLOTS - 1);
+        for(int i = 0; i < MNEMONIC_SLOTS; i++, slot = (slot + 1) & (MNEMONIC_SLOTS - 1)){
+            struct mnemonic_stats* m = &mnemonics[slot];
+            if(m->name[0] == '\0') strcpy(m->name, name);
+            if(strcmp(m->name, name) == 0){
+                m->count++;
+                m->ns += ns;
+                return;
+            }
+        }
+    }
+    other_count++;
+    other_ns += ns;
+}
+
+void stats_line(int kind, size_t bytes){
+    lines[kind]++;
+    bytes_in += bytes;
+}
+
+void stats_file(void){
+    files++;
+}
+
+void stats_output(size_t bytes, size_t program, size_t limit){
+    bytes_out += bytes;
+    if(program >= largest_program){
+        largest_program = program;
+        program_limit = limit;
+    }
+}
+
+static int by_count(const void* a, const void* b){
+    const struct mnemonic_stats* x = a;
+    const struct mnemonic_stats* y = b;
+    if(x->count != y->count) return x->count < y->count ? 1 : -1;
+    return strcmp(x->name, y->name);
+}
+
+void stats_report(void){
+    // to stderr, so the numbers don't mix with errors and other messages
+    static const char* phase_names[STATS_PHASES] = {
+        "read", "rewrite", "tokenize", "parse", "encode", "link", "write"
+    };
+    uint64_t us[STATS_PHASES];
+    for(int i = 0; i < STATS_PHASES; i++) us[i] = phase_ns[i] / 1000;
+    uint64_t assembled = phase_ns[STATS_ASSEMBLE] - phase_ns[STATS_TOKENIZE] - phase_ns[STATS_PARSE];
+    us[STATS_ASSEMBLE] = phase_ns[STATS_ASSEMBLE] > phase_ns[STATS_TOKENIZE] + phase_ns[STATS_PARSE] ? assembled / 1000 : 0;
+    uint64_t total_us = since(&stats_start) / 1000;
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    long peak_rss = usage.ru_maxrss; // KB on Linux
+
+    struct mnemonic_stats sorted[MNEMONIC_SLOTS];
+    int used = 0;
+    for(int i = 0; i < MNEMONIC_SLOTS; i++)
+        if(mnemonics[i].name[0] != '\0') sorted[used++] = mnemonics[i];
+    qsort(sorted, used, sizeof(sorted[0]), by_count);
+
+    int percent = program_limit ? (int)(largest_program * 100 / program_limit) : 0;
+    uint64_t line_total = lines[0] + lines[1] + lines[2];
+
+    if(stats_json){
+        fprintf(stderr, "{\n  \"files\": %llu,\n", (unsigned long long)files);
+        fprintf(stderr, "  \"lines\": {\"total\": %llu, \"code\": %llu, \"blank\": %llu, \"comment\": %llu},\n",
+               (unsigned long long)line_total, (unsigned long long)lines[STATS_LINE_CODE],
+               (unsigned long long)lines[STATS_LINE_BLANK], (unsigned long long)lines[STATS_LINE_COMMENT]);
+        fprintf(stderr, "  \"bytes_in\": %llu,\n  \"bytes_out\": %llu,\n",
+               (unsigned long long)bytes_in, (unsigned long long)bytes_out);
+        fprintf(stderr, "  \"program\": {\"largest\": %zu, \"limit\": %zu, \"percent\": %d},\n",
+               largest_program, program_limit, percent);
+        fprintf(stderr, "  \"peak_rss_kb\": %ld,\n  \"time_us\": {", peak_rss);
+        for(int i = 0; i < STATS_PHASES; i++)
+            fprintf(stderr, "\"%s\": %llu, ", phase_names[i], (unsigned long long)us[i]);
+        fprintf(stderr, "\"total\": %llu},\n  \"mnemonics\": [", (unsigned long long)total_us);
+        for(int i = 0; i < used; i++){
+            fprintf(stderr, "%s\n    {\"name\": \"%s\", \"count\": %llu, \"time_ns\": %llu}", i ? "," : "",
+                   sorted[i].name, (unsigned long long)sorted[i].count, (unsigned long long)sorted[i].ns);
+        }
+        if(other_count)
+            fprintf(stderr, "%s\n    {\"name\": null, \"count\": %llu, \"time_ns\": %llu}", used ? "," : "",
+                   (unsigned long long)other_count, (unsigned long long)other_ns);
+        fprintf(stderr, "%s]\n}\n", used || other_count ? "\n  " : "");
+        return;
+    }
+
+    fprintf(stderr, "stats: %llu files, %llu lines (%llu code, %llu blank, %llu comment)\n",
+           (unsigned long long)files, (unsigned long long)line_total,
+           (unsigned long long)lines[STATS_LINE_CODE], (unsigned long long)lines[STATS_LINE_BLANK],
+           (unsigned long long)lines[STATS_LINE_COMMENT]);
+    fprintf(stderr, "stats: %llu bytes in, %llu bytes out", (unsigned long long)bytes_in, (unsigned long long)bytes_out);
+    if(program_limit)
+        fprintf(stderr, ", largest program %zu of %zu bytes (%d%%)", largest_program, program_limit, percent);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "stats: peak RSS %ld KB\n", peak_rss);
+    fprintf(stderr, "stats: time");
+    for(int i = 0; i < STATS_PHASES; i++)
+        fprintf(stderr, " %s %llu us,", phase_names[i], (unsigned long long)us[i]);
+    fprintf(stderr, " total %llu us\n", (unsigned long long)total_us);
+    for(int i = 0; i < used; i++){
+        fprintf(stderr, "stats: %-8s %10llu %10.1f ns/line\n", sorted[i].name, (unsigned long long)sorted[i].count,
+               (double)sorted[i].ns / sorted[i].count);
+    }
+    if(other_count)
+        fprintf(stderr, "stats: %-8s %10llu %10.1f ns/line\n", "(other)", (unsigned long long)other_count,
+               (double)other_ns / other_count);
+}
+
+#endif
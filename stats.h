@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stddef.h>
+#include <time.h>
+
+// Instrumentation for --stats
+// Counters are global, so with -c they add up over all files. Building with
+// -DNO_STATS (make CFLAGS=-DNO_STATS) turns every STATS_ macro into nothing.
+
+#define STATS_READ 0 // read_source
+#define STATS_REWRITE 1 // --vregs and --rules
+#define STATS_TOKENIZE 2 // splitting and lexing operands
+#define STATS_PARSE 3 // mnemonic dispatch in parse_for_opcode
+#define STATS_ASSEMBLE 4 // all of assemble_source, encoding is this minus the two above
+// Tokenize, parse and the mnemonic counts only take lines assemble_source
+// encodes, not ones --rules, --superopt or --watch patching parse on their own
+#define STATS_LINK 5
+#define STATS_WRITE 6
+#define STATS_PHASES 7
+
+#define STATS_LINE_CODE 0
+#define STATS_LINE_BLANK 1
+#define STATS_LINE_COMMENT 2
+
+#ifdef NO_STATS
+
+#define STATS_ENABLED 0
+#define STATS_ENABLE(json) ((void)0)
+#define STATS_START(t)
+#define STATS_STOP(phase, t) ((void)0)
+#define STATS_ENCODING(on) ((void)0)
+#define STATS_PARSE_START(t)
+#define STATS_PARSE_STOP(phase, t) ((void)0)
+#define STATS_MNEMONIC(name, t) ((void)0)
+#define STATS_LINE(kind, bytes) ((void)0)
+#define STATS_FILE() ((void)0)
+#define STATS_OUTPUT(bytes, program, limit) ((void)0)
+#define STATS_REPORT() ((void)0)
+
+#else
+
+#define STATS_ENABLED 1
+
+extern int stats_on;
+extern int stats_encoding; // inside assemble_source
+
+void stats_enable(int json);
+void stats_time(int phase, const struct timespec* start);
+void stats_mnemonic(const char* name, const struct timespec* start);
+void stats_line(int kind, size_t bytes);
+void stats_file(void);
+void stats_output(size_t bytes, size_t program, size_t limit);
+void stats_report(void);
+
+#define STATS_ENABLE(json) stats_enable(json)
+#define STATS_START(t) struct timespec t = {0, 0}; if(stats_on) clock_gettime(CLOCK_MONOTONIC, &t)
+#define STATS_STOP(phase, t) do { if(stats_on) stats_time(phase, &t); } while(0)
+#define STATS_ENCODING(on) (stats_encoding = (on))
+#define STATS_PARSE_START(t) struct timespec t = {0, 0}; if(stats_on && stats_encoding) clock_gettime(CLOCK_MONOTONIC, &t)
+#define STATS_PARSE_STOP(phase, t) do { if(stats_on && stats_encoding) stats_time(phase, &t); } while(0)
+#define STATS_MNEMONIC(name, t) do { if(stats_on && stats_encoding) stats_mnemonic(name, &t); } while(0)
+#define STATS_LINE(kind, bytes) do { if(stats_on) stats_line(kind, bytes); } while(0)
+#define STATS_FILE() do { if(stats_on) stats_file(); } while(0)
+#define STATS_OUTPUT(bytes, program, limit) do { if(stats_on) stats_output(bytes, program, limit); } while(0)
+#define STATS_REPORT() do { if(stats_on) stats_report(); } while(0)
+
+#endif
@@ -0,0 +1,605 @@
+#include "superopt.h"
+#include "parse.h"
+#include "diag.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <unistd.h>
+
+// Superoptimizer
+// Works on straight-line windows of LD Vx, byte / ADD Vx, byte / 8xy0-8xy5 / 8xy7.
+// Shifts are left out, interpreters disagree on whether they read Vy.
+// A candidate must leave V0-VF exactly as the window does, both with and without
+// the "OR/AND/XOR reset VF" quirk, so rewrites are safe on any interpreter.
+// Step 1: rename registers in order of appearance and hash the result
+// Step 2: enumerate every shorter sequence over those registers and the window's
+//         constants, threads split the work by the first instruction
+// Step 3: reject on a few random states, then check all register values
+// Results (also "nothing found") go to the rule database.
+
+#define VF 0xf
+#define RANDOM_TESTS 32
+#define MAX_CONSTS 32
+#define MAX_ALPHABET (SUPEROPT_MAX_REGS * MAX_CONSTS * 2 + SUPEROPT_MAX_REGS * SUPEROPT_MAX_REGS * 7)
+
+static int in_subset(uint16_t op){
+    switch(op >> 12){
+        case 0x6:
+        case 0x7:
+            return 1;
+        case 0x8:
+            return (op & 0xf) <= 0x5 || (op & 0xf) == 0x7;
+    }
+    return 0;
+}
+
+static void run(const uint16_t* ops, int n, uint8_t* v, int vf_reset){
+    for(int i = 0; i < n; i++){
+        int x = (ops[i] >> 8) & 0xf;
+        int y = (ops[i] >> 4) & 0xf;
+        int flag;
+        if((ops[i] >> 12) == 0x6){
+            v[x] = ops[i] & 0xff;
+        } else if((ops[i] >> 12) == 0x7){
+            v[x] += ops[i] & 0xff;
+        } else {
+            switch(ops[i] & 0xf){
+                case 0x0: v[x] = v[y]; break;
+                case 0x1: v[x] |= v[y]; if(vf_reset) v[VF] = 0; break;
+                case 0x2: v[x] &= v[y]; if(vf_reset) v[VF] = 0; break;
+                case 0x3: v[x] ^= v[y]; if(vf_reset) v[VF] = 0; break;
+                case 0x4:
+                    flag = v[x] + v[y] > 0xff;
+                    v[x] += v[y];
+                    v[VF] = flag;
+                    break;
+                case 0x5:
+                    flag = v[x] >= v[y];
+                    v[x] -= v[y];
+                    v[VF] = flag;
+                    break;
+                case 0x7:
+                    flag = v[y] >= v[x];
+                    v[x] = v[y] - v[x];
+                    v[VF] = flag;
+                    break;
+            }
+        }
+    }
+}
+
+static int same_on(const uint16_t* a, int n, const uint16_t* b, int m, const uint8_t* input){
+    uint8_t va[16], vb[16];
+    for(int vf_reset = 0; vf_reset < 2; vf_reset++){
+        memcpy(va, input, 16);
+        memcpy(vb, input, 16);
+        run(a, n, va, vf_reset);
+        run(b, m, vb, vf_reset);
+        if(memcmp(va, vb, 16) != 0) return 0;
+    }
+    return 1;
+}
+
+static int verify(const uint16_t* a, int n, const uint16_t* b, int m, int k){
+    // every value of every register in the window. VF is never read by these
+    // instructions, so two values are enough to see if it is kept or overwritten
+    uint8_t input[16] = {0};
+    uint32_t total = 1u << (8 * k);
+    for(uint32_t s = 0; s < total; s++){
+        for(int r = 0; r < k; r++) input[r] = s >> (8 * r);
+        input[VF] = 0x00;
+        if(!same_on(a, n, b, m, input)) return 0;
+        input[VF] = 0xff;
+        if(!same_on(a, n, b, m, input)) return 0;
+    }
+    return 1;
+}
+
+static int canonicalize(const uint16_t* ops, int n, uint16_t* out, int* regmap){
+    // regmap[canonical] = real register. Returns register count or -1
+    int map[16];
+    int k = 0;
+    for(int i = 0; i < 16; i++) map[i] = -1;
+
+    for(int i = 0; i < n; i++){
+        if(!in_subset(ops[i])) return -1;
+        int x = (ops[i] >> 8) & 0xf;
+        int y = (ops[i] >> 4) & 0xf;
+        int has_y = (ops[i] >> 12) == 0x8;
+        if(x == VF || (has_y && y == VF)) return -1;
+
+        if(map[x] == -1){
+            if(k == SUPEROPT_MAX_REGS) return -1;
+            regmap[k] = x;
+            map[x] = k++;
+        }
+        if(has_y && map[y] == -1){
+            if(k == SUPEROPT_MAX_REGS) return -1;
+            regmap[k] = y;
+            map[y] = k++;
+        }
+        out[i] = (ops[i] & 0xf000) | map[x] << 8 | (has_y ? (map[y] << 4 | (ops[i] & 0xf)) : (ops[i] & 0xff));
+    }
+    return k;
+}
+
+static uint16_t rename_regs(uint16_t op, const int* regmap){
+    // canonical -> real registers
+    int x = regmap[(op >> 8) & 0xf];
+    if((op >> 12) == 0x8)
+        return (op & 0xf00f) | x << 8 | regmap[(op >> 4) & 0xf] << 4;
+    return (op & 0xf0ff) | x << 8;
+}
+
+static int uses_only(const struct rule* rule, int k){
+    // replacement stays inside the window's k registers
+    for(int i = 0; i < rule->m; i++){
+        if(((rule->to[i] >> 8) & 0xf) >= k) return 0;
+        if((rule->to[i] >> 12) == 0x8 && ((rule->to[i] >> 4) & 0xf) >= k) return 0;
+    }
+    return 1;
+}
+
+static uint32_t hash_window(const uint16_t* ops, int n){
+    // FNV-1a over the canonical opcodes
+    uint32_t h = 2166136261u;
+    h = (h ^ (uint32_t)n) * 16777619u;
+    for(int i = 0; i < n; i++){
+        h = (h ^ (ops[i] >> 8)) * 16777619u;
+        h = (h ^ (ops[i] & 0xff)) * 16777619u;
+    }
+    return h;
+}
+
+// --- rule database ---
+
+static void rules_index(struct rule_db* db){
+    size_t cap = db->index_cap ? db->index_cap : 64;
+    while(cap < db->count * 2 + 2) cap *= 2;
+    free(db->index);
+    db->index = malloc(cap * sizeof(int32_t));
+    if(db->index == NULL){
+        printf("Error: out of memory\n");
+        exit(1);
+    }
+    db->index_cap = cap;
+    for(size_t i = 0; i < cap; i++) db->index[i] = -1;
+    for(size_t i = 0; i < db->count; i++){
+        size_t slot = db->rules[i].hash & (cap - 1);
+        while(db->index[slot] != -1) slot = (slot + 1) & (cap - 1);
+        db->index[slot] = (int32_t)i;
+    }
+}
+
+static void rules_add(struct rule_db* db, const struct rule* rule){
+    if(db->count == db->cap){
+        db->cap = db->cap ? db->cap * 2 : 64;
+        db->rules = realloc(db->rules, db->cap * sizeof(struct rule));
+        if(db->rules == NULL){
+            printf("Error: out of memory\n");
+            exit(1);
+        }
+    }
+    db->rules[db->count++] = *rule;
+
+    if(db->count * 2 + 2 > db->index_cap){
+        rules_index(db);
+    } else {
+        size_t slot = rule->hash & (db->index_cap - 1);
+        while(db->index[slot] != -1) slot = (slot + 1) & (db->index_cap - 1);
+        db->index[slot] = (int32_t)(db->count - 1);
+    }
+}
+
+static const struct rule* rules_find(const struct rule_db* db, const uint16_t* canon, int n){
+    if(db->index_cap == 0) return NULL;
+    uint32_t hash = hash_window(canon, n);
+    size_t slot = hash & (db->index_cap - 1);
+    while(db->index[slot] != -1){
+        const struct rule* rule = &db->rules[db->index[slot]];
+        if(rule->hash == hash && rule->n == n && memcmp(rule->from, canon, n * sizeof(uint16_t)) == 0)
+            return rule;
+        slot = (slot + 1) & (db->index_cap - 1);
+    }
+    return NULL;
+}
+
+static int read_ops(char** cursor, int n, uint16_t* ops){
+    for(int i = 0; i < n; i++){
+        unsigned op;
+        int used;
+        if(sscanf(*cursor, " %x%n", &op, &used) != 1) return -1;
+        ops[i] = op;
+        *cursor += used;
+    }
+    return 0;
+}
+
+int rules_load(struct rule_db* db, const char* path, int create){
+    // one rule per line: hash n from... m to... (m is -1 when nothing was found)
+    memset(db, 0, sizeof(*db));
+    FILE* fp = fopen(path, "r");
+    if(fp == NULL && create) return 0; // no database yet
+    if(fp == NULL){
+        diag_error(DIAG_CANT_OPEN, 0, 0, "can't open file '%s'", path);
+        return 1;
+    }
+
+    char line[256];
+    int linenumber = 0;
+    while(fgets(line, sizeof(line), fp) != NULL){
+        linenumber++;
+        if(line[0] == '#' || line[0] == '\n') continue;
+
+        struct rule rule;
+        char* cursor = line;
+        int used;
+        memset(&rule, 0, sizeof(rule));
+        if(sscanf(cursor, "%x %d%n", &rule.hash, &rule.n, &used) != 2 ||
+           rule.n < 1 || rule.n > SUPEROPT_WINDOW){
+            diag_set_file(path);
+            diag_error(DIAG_BAD_RULE, linenumber, 0, "bad rule on line %d of '%s'", linenumber, path);
+            fclose(fp);
+            return 1;
+        }
+        cursor += used;
+        int ok = read_ops(&cursor, rule.n, rule.from) == 0 &&
+                 sscanf(cursor, " %d%n", &rule.m, &used) == 1 && rule.m < rule.n;
+        cursor += used;
+        if(ok && rule.m > 0) ok = read_ops(&cursor, rule.m, rule.to) == 0;
+        for(int i = 0; i < rule.m && ok; i++)
+            ok = in_subset(rule.to[i]);
+        if(!ok){
+            diag_set_file(path);
+            diag_error(DIAG_BAD_RULE, linenumber, 0, "bad rule on line %d of '%s'", linenumber, path);
+            fclose(fp);
+            return 1;
+        }
+        rules_add(db, &rule);
+    }
+    fclose(fp);
+    return 0;
+}
+
+void rules_free(struct rule_db* db){
+    free(db->rules);
+    free(db->index);
+    memset(db, 0, sizeof(*db));
+}
+
+static void rules_append(FILE* fp, const struct rule* rule){
+    fprintf(fp, "%08x %d", rule->hash, rule->n);
+    for(int i = 0; i < rule->n; i++) fprintf(fp, " %04x", rule->from[i]);
+    fprintf(fp, " %d", rule->m);
+    for(int i = 0; i < rule->m; i++) fprintf(fp, " %04x", rule->to[i]);
+    fputc('\n', fp);
+}
+
+// --- search ---
+
+struct search {
+    const uint16_t* target;
+    int n, k;
+    uint16_t alphabet[MAX_ALPHABET];
+    int alphabet_size;
+    int len; // candidate length
+    long tails; // alphabet_size ^ (len - 1)
+    uint8_t tests[RANDOM_TESTS][16];
+
+    pthread_mutex_t lock;
+    int next_first;
+    long best; // lowest candidate index that passed, -1 if none
+};
+
+static void decode_candidate(const struct search* s, long index, uint16_t* out){
+    for(int i = s->len - 1; i >= 0; i--){
+        out[i] = s->alphabet[index % s->alphabet_size];
+        index /= s->alphabet_size;
+    }
+}
+
+static void* search_worker(void* arg){
+    struct search* s = arg;
+    uint16_t candidate[SUPEROPT_WINDOW];
+
+    for(;;){
+        pthread_mutex_lock(&s->lock);
+        int first = s->next_first++;
+        int done = first >= s->alphabet_size || (s->best != -1 && first > s->best / s->tails);
+        pthread_mutex_unlock(&s->lock);
+        if(done) break;
+
+        for(long tail = 0; tail < s->tails; tail++){
+            long index = first * s->tails + tail;
+            decode_candidate(s, index, candidate);
+
+            int passed = 1;
+            for(int t = 0; t < RANDOM_TESTS && passed; t++)
+                passed = same_on(s->target, s->n, candidate, s->len, s->tests[t]);
+            if(!passed || !verify(s->target, s->n, candidate, s->len, s->k)) continue;
+
+            pthread_mutex_lock(&s->lock);
+            if(s->best == -1 || index < s->best) s->best = index;
+            pthread_mutex_unlock(&s->lock);
+            break; // later tails of this first instruction only have higher indexes
+        }
+    }
+    return NULL;
+}
+
+static void build_alphabet(struct search* s){
+    int seen[256] = {0};
+    int consts[MAX_CONSTS];
+    int count = 0;
+
+    // constants of the window, their sums and differences, and a few usual ones
+    int base[SUPEROPT_WINDOW + 3];
+    int base_count = 0;
+    for(int i = 0; i < s->n; i++){
+        if((s->target[i] >> 12) != 0x8) base[base_count++] = s->target[i] & 0xff;
+    }
+    base[base_count++] = 0x00;
+    base[base_count++] = 0x01;
+    base[base_count++] = 0xff;
+
+    for(int i = 0; i < base_count; i++){
+        for(int j = -1; j < base_count; j++){
+            int values[2] = { j == -1 ? base[i] : (base[i] + base[j]) & 0xff,
+                              j == -1 ? base[i] : (base[i] - base[j]) & 0xff };
+            for(int v = 0; v < 2; v++){
+                if(!seen[values[v]] && count < MAX_CONSTS){
+                    seen[values[v]] = 1;
+                    consts[count++] = values[v];
+                }
+            }
+        }
+    }
+
+    s->alphabet_size = 0;
+    for(int x = 0; x < s->k; x++){
+        for(int c = 0; c < count; c++){
+            s->alphabet[s->alphabet_size++] = 0x6000 | x << 8 | consts[c];
+            if(consts[c] != 0) s->alphabet[s->alphabet_size++] = 0x7000 | x << 8 | consts[c];
+        }
+        for(int y = 0; y < s->k; y++){
+            static const int ops[] = {0x0, 0x1, 0x2, 0x3, 0x4, 0x5, 0x7};
+            for(int o = 0; o < 7; o++){
+                if(ops[o] == 0x0 && x == y) continue; // LD Vx, Vx does nothing
+                s->alphabet[s->alphabet_size++] = 0x8000 | x << 8 | y << 4 | ops[o];
+            }
+        }
+    }
+}
+
+static int thread_count(void){
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n < 1 ? 1 : (n > 64 ? 64 : (int)n);
+}
+
+static void search_window(const uint16_t* canon, int n, int k, struct rule* rule){
+    static struct search s; // big, and searches run one at a time
+    memset(&s, 0, sizeof(s));
+    s.target = canon;
+    s.n = n;
+    s.k = k;
+    build_alphabet(&s);
+
+    // fixed seed, so the same window always gives the same rule
+    uint32_t seed = 0x2545f491;
+    for(int t = 0; t < RANDOM_TESTS; t++){
+        for(int r = 0; r < 16; r++){
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+            s.tests[t][r] = seed & 0xff;
+        }
+    }
+
+    rule->hash = hash_window(canon, n);
+    rule->n = n;
+    rule->m = -1;
+    memcpy(rule->from, canon, n * sizeof(uint16_t));
+
+    if(verify(canon, n, NULL, 0, k)){ // window does nothing at all
+        rule->m = 0;
+        return;
+    }
+
+    int threads = thread_count();
+    pthread_t ids[64];
+    pthread_mutex_init(&s.lock, NULL);
+    for(s.len = 1; s.len < n; s.len++){
+        s.tails = 1;
+        for(int i = 1; i < s.len; i++) s.tails *= s.alphabet_size;
+        s.next_first = 0;
+        s.best = -1;
+
+        for(int t = 0; t < threads; t++) pthread_create(&ids[t], NULL, search_worker, &s);
+        for(int t = 0; t < threads; t++) pthread_join(ids[t], NULL);
+
+        if(s.best != -1){
+            rule->m = s.len;
+            decode_candidate(&s, s.best, rule->to);
+            break;
+        }
+    }
+    pthread_mutex_destroy(&s.lock);
+}
+
+// --- source windows ---
+
+struct straight {
+    int line; // index in source
+    uint16_t opcode;
+    int usable; // in the searched subset
+    int labeled;
+    int after_skip; // the skip must keep jumping over exactly this instruction
+};
+
+static int collect(struct source* src, struct straight* out){
+    // instruction lines in order, with what breaks a straight-line run
+    char line[1024];
+    int count = 0;
+    int label_pending = 0;
+    int after_skip = 0;
+
+    for(int n = 0; n < src->count; n++){
+        strncpy(line, src->lines[n].text, sizeof(line) - 1);
+        line[sizeof(line) - 1] = '\0';
+
+        char* code = line;
+        while(isspace((unsigned char)*code)) code++;
+        char* colon = strchr(code, ':');
+        if(colon != NULL){
+            *colon = '\0';
+            if(is_symbol_name(code)){
+                label_pending = 1;
+                code = colon + 1;
+            } else {
+                *colon = ':';
+            }
+        }
+        while(isspace((unsigned char)*code)) code++;
+        if(*code == '\0') continue;
+
+        int opcode = parse_for_opcode(code);
+        out[count].line = n;
+        out[count].opcode = opcode < 0 ? 0 : opcode;
+        out[count].usable = opcode >= 0 && opcode < OPCODE_LONG && in_subset(opcode);
+        out[count].labeled = label_pending;
+        out[count].after_skip = after_skip;
+        count++;
+
+        label_pending = 0;
+        int group = opcode < 0 ? 0 : opcode >> 12;
+        after_skip = group == 0x3 || group == 0x4 || group == 0x5 || group == 0x9 || group == 0xe;
+    }
+    return count;
+}
+
+static int window_at(const struct straight* ins, int count, int at, int n, uint16_t* ops){
+    // n instructions from 'at' that can be replaced as a whole.
+    // A label may only sit on the first one.
+    if(at + n > count || ins[at].after_skip) return 0;
+    for(int i = 0; i < n; i++){
+        if(!ins[at + i].usable) return 0;
+        if(i > 0 && ins[at + i].labeled) return 0;
+        ops[i] = ins[at + i].opcode;
+    }
+    return 1;
+}
+
+static void disassemble(uint16_t op, char* out, size_t size){
+    static const char* names[] = {"LD", "OR", "AND", "XOR", "ADD", "SUB", "", "SUBN"};
+    int x = (op >> 8) & 0xf;
+    if((op >> 12) == 0x6)
+        snprintf(out, size, "LD V%X, 0x%02X", x, op & 0xff);
+    else if((op >> 12) == 0x7)
+        snprintf(out, size, "ADD V%X, 0x%02X", x, op & 0xff);
+    else
+        snprintf(out, size, "%s V%X, V%X", names[op & 0x7], x, (op >> 4) & 0xf);
+}
+
+int apply_rules(struct source* src, const struct rule_db* db){
+    // replace windows that have a shorter rule, longest windows first
+    struct straight* ins = malloc((src->count + 1) * sizeof(struct straight));
+    if(ins == NULL){
+        printf("Error: out of memory\n");
+        exit(1);
+    }
+    int count = collect(src, ins);
+
+    struct source out;
+    memset(&out, 0, sizeof(out));
+    int next_line = 0; // first source line not copied yet
+    for(int at = 0; at < count; at++){
+        for(int n = SUPEROPT_WINDOW; n >= 2; n--){
+            uint16_t ops[SUPEROPT_WINDOW], canon[SUPEROPT_WINDOW];
+            int regmap[SUPEROPT_MAX_REGS];
+            if(!window_at(ins, count, at, n, ops)) continue;
+            int k = canonicalize(ops, n, canon, regmap);
+            if(k == -1) continue;
+            const struct rule* rule = rules_find(db, canon, n);
+            if(rule == NULL || rule->m < 0) continue;
+            if(!uses_only(rule, k)) continue;
+
+            int first = ins[at].line;
+            int linenumber = src->lines[first].linenumber;
+            for(; next_line < first; next_line++)
+                add_source_line(&out, src->lines[next_line].text, src->lines[next_line].linenumber);
+
+            if(ins[at].labeled){
+                // keep 'name:' from the first line
+                char label[1024];
+                strncpy(label, src->lines[first].text, sizeof(label) - 1);
+                label[sizeof(label) - 1] = '\0';
+                char* colon = strchr(label, ':');
+                if(colon != NULL){
+                    colon[1] = '\0';
+                    add_source_line(&out, label, linenumber);
+                }
+            }
+            for(int i = 0; i < rule->m; i++){
+                char text[32];
+                disassemble(rename_regs(rule->to[i], regmap), text, sizeof(text));
+                add_source_line(&out, text, linenumber);
+            }
+            next_line = ins[at + n - 1].line + 1;
+            at += n - 1;
+            break;
+        }
+    }
+    for(; next_line < src->count; next_line++)
+        add_source_line(&out, src->lines[next_line].text, src->lines[next_line].linenumber);
+
+    free(ins);
+    free_source(src);
+    *src = out;
+    return 0;
+}
+
+int superoptimize_source(struct source* src, struct rule_db* db, const char* path){
+    // search every window of the source that isn't in the database yet
+    struct straight* ins = malloc((src->count + 1) * sizeof(struct straight));
+    if(ins == NULL){
+        printf("Error: out of memory\n");
+        exit(1);
+    }
+    int count = collect(src, ins);
+
+    FILE* fp = fopen(path, "a");
+    if(fp == NULL){
+        diag_error(DIAG_CANT_OPEN, 0, 0, "can't open file '%s'", path);
+        free(ins);
+        return 1;
+    }
+    if(ftell(fp) == 0)
+        fprintf(fp, "# superopt rules: hash n from... m to... (registers renamed V0, V1... in order)\n");
+
+    for(int at = 0; at < count; at++){
+        for(int n = 2; n <= SUPEROPT_WINDOW; n++){
+            uint16_t ops[SUPEROPT_WINDOW], canon[SUPEROPT_WINDOW];
+            int regmap[SUPEROPT_MAX_REGS];
+            if(!window_at(ins, count, at, n, ops)) break;
+            int k = canonicalize(ops, n, canon, regmap);
+            if(k == -1) break;
+            if(rules_find(db, canon, n) != NULL) continue; // cached
+
+            struct rule rule;
+            search_window(canon, n, k, &rule);
+            rules_add(db, &rule);
+            rules_append(fp, &rule);
+            fflush(fp);
+            if(rule.m >= 0){
+                printf("superopt: line %d: %d instructions -> %d\n",
+                       src->lines[ins[at].line].linenumber, n, rule.m);
+            }
+        }
+    }
+
+    fclose(fp);
+    free(ins);
+    return 0;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "asm.h"
+
+#define SUPEROPT_WINDOW 4 // longest instruction sequence searched
+#define SUPEROPT_MAX_REGS 3 // most distinct registers in one window
+#define SUPEROPT_DEFAULT_RULES "superopt.rules"
+
+// A rewrite in canonical form: registers renamed V0, V1... in order of
+// appearance. m == -1 means the search found nothing shorter.
+struct rule {
+    uint32_t hash;
+    int n, m;
+    uint16_t from[SUPEROPT_WINDOW], to[SUPEROPT_WINDOW];
+};
+
+struct rule_db {
+    struct rule* rules;
+    size_t count, cap;
+    int32_t* index; // open addressing by hash, -1 is an empty slot
+    size_t index_cap;
+};
+
+// A missing file is an empty database when create is set (--superopt makes it),
+// an error otherwise
+int rules_load(struct rule_db*, const char* path, int create);
+void rules_free(struct rule_db*);
+
+int apply_rules(struct source*, const struct rule_db*);
+int superoptimize_source(struct source*, struct rule_db*, const char*);
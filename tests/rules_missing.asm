@@ -0,0 +1,5 @@
+; options: --rules missing.rules
+; applying rules from a file that is not there is an error
+main:
+    ADD V1, 3
+.end: JP .end
@@ -0,0 +1,30 @@
+#!/bin/sh
+# Regression checks. Every tests/NAME.asm is assembled in a scratch directory
+# with the options on its first line ('; options: ...'). What it prints and
+# the exit status must match NAME.out, and the image NAME.ch8 when there is one.
+# Run from the top directory, 'make check' does that.
+
+compiler="$PWD/chip8-compiler"
+scratch=$(mktemp -d) || exit 1
+trap 'rm -rf "$scratch"' EXIT
+failed=0
+
+for source in tests/*.asm; do
+    name=$(basename "$source" .asm)
+    options=$(sed -n '1s/^; options://p' "$source")
+    cp "$source" "$scratch/$name.asm"
+    rm -f "$scratch/$name.ch8"
+    (cd "$scratch" && "$compiler" $options "$name.asm" > "$name.log"; echo "exit $?" >> "$name.log")
+
+    if ! cmp -s "$scratch/$name.log" "tests/$name.out"; then
+        echo "FAIL $name: output"
+        diff "tests/$name.out" "$scratch/$name.log"
+        failed=1
+    elif [ -f "tests/$name.ch8" ] && ! cmp -s "$scratch/$name.ch8" "tests/$name.ch8"; then
+        echo "FAIL $name: image"
+        failed=1
+    else
+        echo "ok   $name"
+    fi
+done
+exit $failed
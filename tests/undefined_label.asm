@@ -0,0 +1,6 @@
+; options:
+; a bad line and a missing label are both reported, the label with its line
+main:
+    FOO V1
+    LD I, nowhere
+.end: JP .end
@@ -0,0 +1,47 @@
+; options: --vregs
+; I is set again after the CALL, so sub may spill
+main:
+    LD I, 0x800
+    CALL sub
+    LD V1, 42
+    LD I, 0x800
+    LD B, V1
+.end: JP .end
+sub:
+    LD %v0, 1
+    LD %v1, 2
+    LD %v2, 3
+    LD %v3, 4
+    LD %v4, 5
+    LD %v5, 6
+    LD %v6, 7
+    LD %v7, 8
+    LD %v8, 9
+    LD %v9, 10
+    LD %v10, 11
+    LD %v11, 12
+    LD %v12, 13
+    LD %v13, 14
+    LD %v14, 15
+    LD %v15, 16
+    LD %v16, 17
+    LD %v17, 18
+    ADD %v16, %v17
+    ADD %v15, %v16
+    ADD %v14, %v15
+    ADD %v13, %v14
+    ADD %v12, %v13
+    ADD %v11, %v12
+    ADD %v10, %v11
+    ADD %v9, %v10
+    ADD %v8, %v9
+    ADD %v7, %v8
+    ADD %v6, %v7
+    ADD %v5, %v6
+    ADD %v4, %v5
+    ADD %v3, %v4
+    ADD %v2, %v3
+    ADD %v1, %v2
+    ADD %v0, %v1
+    LD VE, %v0
+    RET
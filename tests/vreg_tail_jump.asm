@@ -0,0 +1,15 @@
+; options: --vregs
+; a tail jump to b, so a call to a changes what b changes
+main:
+    LD %keep, 77
+    CALL a
+    LD V1, %keep
+.end: JP .end
+a:
+    LD %x, 1
+    JP b
+b:
+    LD %y, 5
+    LD %z, 6
+    ADD %y, %z
+    RET
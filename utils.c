@@ -1,9 +1,9 @@
 #include <string.h>
 #include <stdlib.h>
 
-char* get_filename_for_binary(const char* filename) {
-    // Create new filename for binary.
-    // Change suffix after latest dot to 'ch8',
+char* get_filename_with_suffix(const char* filename, const char* suffix) {
+    // Create new filename with given suffix (like ".ch8").
+    // Change suffix after latest dot,
     // Or add it if no suffic provided
     const char* last_dot = strrchr(filename, '.');
     size_t base_len;
@@ -13,14 +13,18 @@ char* get_filename_for_binary(const char* filename) {
         base_len = strlen(filename);
     }   
 
-    // ".ch8" + '\0' = 5
-    char* binary_filename = malloc(base_len + 5); 
+    // suffix + '\0'
+    char* binary_filename = malloc(base_len + strlen(suffix) + 1); 
     if (!binary_filename) return NULL;
 
     strncpy(binary_filename, filename, base_len);
-    strcpy(binary_filename + base_len, ".ch8");
+    strcpy(binary_filename + base_len, suffix);
 
     return binary_filename;
 }
 
+char* get_filename_for_binary(const char* filename) {
+    return get_filename_with_suffix(filename, ".ch8");
+}
+
 
@@ -1,3 +1,4 @@
 #pragma once
 
 char* get_filename_for_binary(const char*);
+char* get_filename_with_suffix(const char*, const char*);
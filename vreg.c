@@ -0,0 +1,708 @@
+#include "vreg.h"
+#include "parse.h"
+#include "diag.h"
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+// Virtual registers
+// A routine starts at every label not beginning with '.', '%name' operands
+// inside it are virtual registers. Per routine:
+// Step 1: liveness analysis over the routine's control flow
+// Step 2: interference graph, colored greedily onto V0-VE (VF is never used,
+//         arithmetic clobbers it). Registers named directly anywhere in the file
+//         are left alone, and values live across CALL avoid whatever the callee clobbers
+// Step 3: only if colors run out, spill to a scratch byte. V0 is reserved then,
+//         reloads go 'LD I, slot' + 'LD V0, [I]', so they clobber I. Values
+//         used while I holds an address that is still needed are never spilled,
+//         I has its own liveness over the whole file for that. When one
+//         instruction has two spilled operands, the second one is moved on into
+//         another reserved register
+
+#define ALL_REGS 0xffff
+#define PALETTE 0x7fff // V0-VE
+
+struct insn {
+    char* buffer; // owns label, mnemonic and ops
+    char* label;
+    char* mnemonic; // NULL on lines with no instruction
+    char* ops[3];
+    int op_count;
+    int vreg[3]; // virtual register id of each operand, -1 otherwise
+    uint64_t use, def;
+    uint8_t i_in, i_out; // I holds an address that is read later
+    int linenumber;
+};
+
+struct routine {
+    int first, last; // insn range [first, last)
+    char* names[VREG_MAX];
+    int vreg_count;
+    int state; // 0 - not done, 1 - in progress, 2 - done
+    uint16_t clobber;
+    int color[VREG_MAX]; // register, or -2 - slot when spilled
+    int spill_base;
+    int scratch; // register for a second spilled operand, -1 if not needed
+    uint8_t labels_i; // I is live at some label, for JP V0
+    uint8_t keeps_i; // a caller still needs I after RET
+};
+
+struct vreg_ctx {
+    struct insn* insns;
+    int count;
+    struct routine* routines;
+    int routine_count;
+    uint16_t explicit_regs; // Vx written by hand anywhere in the file
+    int spill_slots;
+    int error; // set when a callee fails while allocating its caller
+};
+
+static int is_skip(const char* m){
+    return strcmp(m, "SE") == 0 || strcmp(m, "SNE") == 0 ||
+           strcmp(m, "SKP") == 0 || strcmp(m, "SKNP") == 0;
+}
+
+static int writes_first(const char* m){
+    // first operand is only written
+    return strcmp(m, "LD") == 0 || strcmp(m, "RND") == 0;
+}
+
+static int updates_first(const char* m){
+    // first operand is read and written
+    return strcmp(m, "ADD") == 0 || strcmp(m, "OR") == 0 || strcmp(m, "AND") == 0 ||
+           strcmp(m, "XOR") == 0 || strcmp(m, "SUB") == 0 || strcmp(m, "SUBN") == 0 ||
+           strcmp(m, "SHR") == 0 || strcmp(m, "SHL") == 0;
+}
+
+static int is_range(const struct insn* in){
+    // instructions that work on a range of registers
+    if(in->op_count != 2) return 0;
+    if(strcmp(in->mnemonic, "SAVE") == 0 || strcmp(in->mnemonic, "LOAD") == 0) return 1;
+    return strcmp(in->mnemonic, "LD") == 0 &&
+           (strcmp(in->ops[0], "[I]") == 0 || strcmp(in->ops[1], "[I]") == 0 ||
+            strcmp(in->ops[0], "R") == 0 || strcmp(in->ops[1], "R") == 0);
+}
+
+static int reads_i(const struct insn* in){
+    // a CALL may draw with the address its caller left in I
+    const char* m = in->mnemonic;
+    if(strcmp(m, "DRW") == 0 || strcmp(m, "SAVE") == 0 || strcmp(m, "LOAD") == 0 ||
+       strcmp(m, "AUDIO") == 0 || strcmp(m, "CALL") == 0)
+        return 1;
+    if(in->op_count != 2) return 0;
+    if(strcmp(m, "ADD") == 0) return strcmp(in->ops[0], "I") == 0;
+    return strcmp(m, "LD") == 0 &&
+           (strcmp(in->ops[0], "B") == 0 || strcmp(in->ops[0], "[I]") == 0 || strcmp(in->ops[1], "[I]") == 0);
+}
+
+static int sets_i(const struct insn* in){
+    if(strcmp(in->mnemonic, "LD") != 0 || in->op_count < 2) return 0;
+    return strcmp(in->ops[0], "I") == 0 || strcmp(in->ops[0], "F") == 0 || strcmp(in->ops[0], "HF") == 0;
+}
+
+static int phys_reg(const char* op){
+    // 'Vx' -> x, otherwise -1
+    if(op[0] != 'V' || op[1] == '\0' || op[2] != '\0') return -1;
+    if(op[1] >= '0' && op[1] <= '9') return op[1] - '0';
+    if(op[1] >= 'A' && op[1] <= 'F') return op[1] - 'A' + 10;
+    return -1;
+}
+
+static void split_insn(struct insn* in, const char* text, int linenumber){
+    memset(in, 0, sizeof(*in));
+    in->linenumber = linenumber;
+    in->vreg[0] = in->vreg[1] = in->vreg[2] = -1;
+    in->buffer = malloc(strlen(text) + 1);
+    if(in->buffer == NULL){
+        printf("Error: out of memory\n");
+        exit(1);
+    }
+    strcpy(in->buffer, text);
+
+    char* rest = in->buffer;
+    while(isspace((unsigned char)*rest)) rest++;
+    char* colon = strchr(rest, ':');
+    if(colon != NULL){
+        *colon = '\0';
+        if(is_symbol_name(rest)){
+            in->label = rest;
+            rest = colon + 1;
+        } else {
+            *colon = ':';
+        }
+    }
+
+    char* token = strtok(rest, " \t,\r\n");
+    if(token == NULL) return;
+    in->mnemonic = token;
+    while((token = strtok(NULL, " \t,\r\n")) != NULL && in->op_count < 3)
+        in->ops[in->op_count++] = token;
+}
+
+static int find_label(struct vreg_ctx* ctx, int first, int last, const char* name){
+    for(int i = first; i < last; i++){
+        if(ctx->insns[i].label && strcmp(ctx->insns[i].label, name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static int routine_of(struct vreg_ctx* ctx, int insn){
+    for(int r = 0; r < ctx->routine_count; r++){
+        if(insn >= ctx->routines[r].first && insn < ctx->routines[r].last)
+            return r;
+    }
+    return -1;
+}
+
+static int next_insn(struct vreg_ctx* ctx, int i, int last){
+    // next line with an instruction
+    for(i++; i < last; i++){
+        if(ctx->insns[i].mnemonic) return i;
+    }
+    return last;
+}
+
+static int scan_routine(struct vreg_ctx* ctx, struct routine* r){
+    // collect virtual register names and use/def sets, bad names are
+    // reported all at once
+    int result = 0;
+    for(int i = r->first; i < r->last; i++){
+        struct insn* in = &ctx->insns[i];
+        if(in->mnemonic == NULL) continue;
+
+        for(int k = 0; k < in->op_count; k++){
+            char* op = in->ops[k];
+            int reg = phys_reg(op);
+            if(reg != -1){
+                ctx->explicit_regs |= 1 << reg;
+                continue;
+            }
+            if(op[0] != '%') continue;
+
+            if(is_range(in)){
+                diag_error(DIAG_VREG_RANGE, in->linenumber, 0, "virtual register can't be used with a register range on line %d", in->linenumber);
+                result = 9;
+                continue;
+            }
+            if(!is_symbol_name(op + 1)){
+                diag_error(DIAG_VREG_NAME, in->linenumber, 0, "bad virtual register name '%s' on line %d", op, in->linenumber);
+                result = 9;
+                continue;
+            }
+
+            int id;
+            for(id = 0; id < r->vreg_count; id++){
+                if(strcmp(r->names[id], op) == 0) break;
+            }
+            if(id == r->vreg_count){
+                if(r->vreg_count == VREG_MAX){
+                    diag_error(DIAG_VREG_COUNT, in->linenumber, 0, "more than %d virtual registers in one routine on line %d", VREG_MAX, in->linenumber);
+                    return 9;
+                }
+                r->names[r->vreg_count++] = op;
+            }
+            in->vreg[k] = id;
+
+            if(k == 0 && writes_first(in->mnemonic)){
+                in->def |= 1ULL << id;
+            } else if(k == 0 && updates_first(in->mnemonic)){
+                in->def |= 1ULL << id;
+                in->use |= 1ULL << id;
+            } else {
+                in->use |= 1ULL << id;
+            }
+        }
+
+        // LD [I], Vx, LD Vx, [I] and the R forms touch V0..Vx,
+        // SAVE Vx, Vy and LOAD Vx, Vy touch Vx..Vy
+        if(is_range(in)){
+            int from = 0, to = -1;
+            if(in->mnemonic[0] != 'L' || in->mnemonic[1] != 'D'){
+                from = phys_reg(in->ops[0]);
+                to = phys_reg(in->ops[1]);
+            } else if(phys_reg(in->ops[0]) != -1){
+                to = phys_reg(in->ops[0]);
+            } else {
+                to = phys_reg(in->ops[1]);
+            }
+            if(from > to){
+                int swap = from;
+                from = to;
+                to = swap;
+            }
+            if(from >= 0) ctx->explicit_regs |= ((2 << to) - 1) & ~((1 << from) - 1);
+        }
+    }
+    return result;
+}
+
+static int successors(struct vreg_ctx* ctx, struct routine* r, int i, int* succ){
+    struct insn* in = &ctx->insns[i];
+    int n = 0;
+
+    if(in->mnemonic == NULL){
+        if(i + 1 < r->last) succ[n++] = i + 1;
+        return n;
+    }
+    if(strcmp(in->mnemonic, "RET") == 0 || strcmp(in->mnemonic, "EXIT") == 0)
+        return 0;
+    if(strcmp(in->mnemonic, "JP") == 0){
+        if(in->op_count == 1){
+            int target = find_label(ctx, r->first, r->last, in->ops[0]);
+            if(target != -1) succ[n++] = target;
+            return n;
+        }
+        return -1; // JP V0 could land on any label
+    }
+    if(i + 1 < r->last) succ[n++] = i + 1;
+    if(is_skip(in->mnemonic)){
+        int skipped = next_insn(ctx, i, r->last);
+        if(skipped + 1 < r->last) succ[n++] = skipped + 1;
+    }
+    return n;
+}
+
+static int i_after_exit(struct vreg_ctx* ctx, struct routine* r, int i){
+    // whether I is still needed when control leaves the routine after line i,
+    // by RET, a jump to another routine, or running into the next one
+    struct insn* in = &ctx->insns[i];
+    int next = r->last < ctx->count ? ctx->insns[r->last].i_in : 0;
+    if(in->mnemonic == NULL) return i + 1 == r->last ? next : 0;
+    if(strcmp(in->mnemonic, "RET") == 0) return r->keeps_i;
+    if(strcmp(in->mnemonic, "EXIT") == 0) return 0;
+    if(strcmp(in->mnemonic, "JP") == 0){
+        if(in->op_count != 1) return 0; // JP V0 stays in the routine
+        int target = find_label(ctx, 0, ctx->count, in->ops[0]);
+        if(target == -1) return 1; // another file or a plain address
+        if(target >= r->first && target < r->last) return 0;
+        return ctx->insns[target].i_in;
+    }
+    if(i + 1 == r->last) return next;
+    if(is_skip(in->mnemonic) && next_insn(ctx, i, r->last) + 1 >= r->last) return next;
+    return 0;
+}
+
+static int call_target(struct vreg_ctx* ctx, struct insn* in){
+    // routine a CALL goes to, -1 if it isn't in this file
+    if(in->op_count != 1) return -1;
+    int target = find_label(ctx, 0, ctx->count, in->ops[0]);
+    return target == -1 ? -1 : routine_of(ctx, target);
+}
+
+static void i_liveness(struct vreg_ctx* ctx){
+    // backward over every routine until nothing changes, they depend on each
+    // other through calls, jumps and running into the next routine. A routine
+    // keeps I at RET when a caller here reads it after the CALL, or when
+    // nothing here calls it, since a caller in another file might
+    for(int k = 0; k < ctx->routine_count; k++) ctx->routines[k].keeps_i = 1;
+    for(int i = 0; i < ctx->count; i++){
+        struct insn* in = &ctx->insns[i];
+        int callee = in->mnemonic && strcmp(in->mnemonic, "CALL") == 0 ? call_target(ctx, in) : -1;
+        if(callee != -1) ctx->routines[callee].keeps_i = 0;
+    }
+
+    int changed = 1;
+    while(changed){
+        changed = 0;
+        for(int k = ctx->routine_count - 1; k >= 0; k--){
+            struct routine* r = &ctx->routines[k];
+            for(int i = r->last - 1; i >= r->first; i--){
+                int succ[2];
+                int n = successors(ctx, r, i, succ);
+                uint8_t out = 0;
+                if(n == -1){
+                    out = r->labels_i;
+                } else {
+                    for(int s = 0; s < n; s++) out |= ctx->insns[succ[s]].i_in;
+                }
+                out |= i_after_exit(ctx, r, i);
+                struct insn* in = &ctx->insns[i];
+                uint8_t new_in = out;
+                if(in->mnemonic && reads_i(in)) new_in = 1;
+                else if(in->mnemonic && sets_i(in)) new_in = 0;
+                if(out != in->i_out || new_in != in->i_in){
+                    in->i_out = out;
+                    in->i_in = new_in;
+                    changed = 1;
+                }
+                if(in->label) r->labels_i |= new_in;
+                if(in->i_out && in->mnemonic && strcmp(in->mnemonic, "CALL") == 0){
+                    int callee = call_target(ctx, in);
+                    if(callee != -1 && !ctx->routines[callee].keeps_i){
+                        ctx->routines[callee].keeps_i = 1;
+                        changed = 1;
+                    }
+                }
+            }
+        }
+    }
+}
+
+static uint16_t callee_clobber(struct vreg_ctx* ctx, struct insn* in);
+static uint16_t routine_clobber(struct vreg_ctx* ctx, int index);
+
+static int falls_through(struct vreg_ctx* ctx, struct routine* r){
+    // whether control can run past the last line into the next routine
+    int last = -1, before = -1;
+    for(int i = r->first; i < r->last; i++){
+        if(ctx->insns[i].mnemonic == NULL) continue;
+        before = last;
+        last = i;
+    }
+    if(last == -1) return 1;
+    if(before != -1 && is_skip(ctx->insns[before].mnemonic)) return 1;
+    const char* m = ctx->insns[last].mnemonic;
+    return strcmp(m, "RET") != 0 && strcmp(m, "EXIT") != 0 && strcmp(m, "JP") != 0;
+}
+
+static int spilled_count(struct routine* r, struct insn* in){
+    // different spilled virtual registers the line uses
+    int count = 0;
+    for(int k = 0; k < in->op_count; k++){
+        if(in->vreg[k] == -1 || r->color[in->vreg[k]] >= 0) continue;
+        int seen = 0;
+        for(int j = 0; j < k; j++)
+            if(in->vreg[j] == in->vreg[k]) seen = 1;
+        if(!seen) count++;
+    }
+    return count;
+}
+
+static int needs_scratch(struct vreg_ctx* ctx, struct routine* r){
+    for(int i = r->first; i < r->last; i++)
+        if(ctx->insns[i].mnemonic && spilled_count(r, &ctx->insns[i]) > 1) return 1;
+    return 0;
+}
+
+static int allocate_routine(struct vreg_ctx* ctx, int index){
+    struct routine* r = &ctx->routines[index];
+    int count = r->last - r->first;
+    r->state = 1;
+
+    // callees first, values live across CALL must avoid their registers
+    uint16_t* call_clobber = calloc(count, sizeof(uint16_t));
+    uint64_t* live_in = calloc(count, sizeof(uint64_t));
+    uint64_t* live_out = calloc(count, sizeof(uint64_t));
+    if(call_clobber == NULL || live_in == NULL || live_out == NULL){
+        printf("Error: out of memory\n");
+        exit(1);
+    }
+    r->clobber = 0;
+    for(int i = r->first; i < r->last; i++){
+        struct insn* in = &ctx->insns[i];
+        if(in->mnemonic && strcmp(in->mnemonic, "CALL") == 0){
+            call_clobber[i - r->first] = callee_clobber(ctx, in);
+            r->clobber |= call_clobber[i - r->first];
+        }
+        // a tail jump returns through the other routine's RET
+        if(in->mnemonic && strcmp(in->mnemonic, "JP") == 0 && in->op_count == 1){
+            int target = find_label(ctx, 0, ctx->count, in->ops[0]);
+            if(target == -1) r->clobber = ALL_REGS; // another file or a plain address
+            else if(target < r->first || target >= r->last) r->clobber |= routine_clobber(ctx, routine_of(ctx, target));
+        }
+    }
+    if(index + 1 < ctx->routine_count && falls_through(ctx, r))
+        r->clobber |= routine_clobber(ctx, index + 1);
+
+    // Step 1: backward liveness until nothing changes
+    uint64_t all_labels_in = 0;
+    int changed = 1;
+    while(changed){
+        changed = 0;
+        for(int i = r->last - 1; i >= r->first; i--){
+            int succ[2];
+            int n = successors(ctx, r, i, succ);
+            uint64_t out = 0;
+            if(n == -1){
+                out = all_labels_in;
+            } else {
+                for(int k = 0; k < n; k++) out |= live_in[succ[k] - r->first];
+            }
+            struct insn* in = &ctx->insns[i];
+            uint64_t new_in = in->use | (out & ~in->def);
+            if(out != live_out[i - r->first] || new_in != live_in[i - r->first]){
+                live_out[i - r->first] = out;
+                live_in[i - r->first] = new_in;
+                changed = 1;
+            }
+            if(in->label) all_labels_in |= new_in;
+        }
+    }
+
+    // a reload or store around a line where I is live would lose the address
+    uint64_t no_spill = 0;
+    int no_spill_line[VREG_MAX];
+    for(int i = r->last - 1; i >= r->first; i--){
+        if(!ctx->insns[i].i_in && !ctx->insns[i].i_out) continue;
+        for(int k = 0; k < ctx->insns[i].op_count; k++){
+            int v = ctx->insns[i].vreg[k];
+            if(v == -1) continue;
+            no_spill |= 1ULL << v;
+            no_spill_line[v] = ctx->insns[i].linenumber;
+        }
+    }
+
+    // Step 2: interference
+    uint64_t adj[VREG_MAX] = {0};
+    uint16_t forbidden[VREG_MAX] = {0};
+    for(int i = r->first; i < r->last; i++){
+        struct insn* in = &ctx->insns[i];
+        uint64_t out = live_out[i - r->first];
+        uint64_t keep = out;
+        // LD %a, %b: a and b may share a register
+        if(strcmp(in->mnemonic ? in->mnemonic : "", "LD") == 0 && in->vreg[1] != -1)
+            keep &= ~(1ULL << in->vreg[1]);
+        for(int v = 0; v < r->vreg_count; v++){
+            if(in->def & (1ULL << v)){
+                adj[v] |= keep & ~(1ULL << v);
+                for(int w = 0; w < r->vreg_count; w++){
+                    if(w != v && (keep & (1ULL << w))) adj[w] |= 1ULL << v;
+                }
+            }
+            if(out & (1ULL << v))
+                forbidden[v] |= call_clobber[i - r->first];
+        }
+    }
+    uint64_t entry = count ? live_in[0] : 0;
+    for(int v = 0; v < r->vreg_count; v++){
+        if(entry & (1ULL << v)) adj[v] |= entry & ~(1ULL << v);
+    }
+
+    // Step 3: greedy coloring, values that can't be spilled first, then the
+    // most constrained
+    int order[VREG_MAX], rank[VREG_MAX];
+    for(int v = 0; v < r->vreg_count; v++){
+        order[v] = v;
+        rank[v] = __builtin_popcountll(adj[v]) + ((no_spill >> v) & 1) * (VREG_MAX + 1);
+    }
+    for(int a = 1; a < r->vreg_count; a++){
+        int v = order[a], b = a;
+        while(b > 0 && rank[order[b - 1]] < rank[v]){
+            order[b] = order[b - 1];
+            b--;
+        }
+        order[b] = v;
+    }
+
+    uint16_t palette = PALETTE & ~ctx->explicit_regs;
+    int spilled;
+    r->scratch = -1;
+    for(;;){
+        spilled = 0;
+        for(int a = 0; a < r->vreg_count; a++){
+            int v = order[a];
+            uint16_t free_regs = palette & ~forbidden[v];
+            for(int w = 0; w < a; w++){
+                int u = order[w];
+                if((adj[v] & (1ULL << u)) && r->color[u] != -1)
+                    free_regs &= ~(1 << r->color[u]);
+            }
+            if(free_regs){
+                r->color[v] = __builtin_ctz(free_regs);
+            } else {
+                r->color[v] = -1;
+                spilled++;
+            }
+        }
+        if(spilled == 0 || (ctx->explicit_regs & 1)) break;
+        if(palette & 1){
+            palette &= ~1; // V0 holds reloaded values from now on, color again
+        } else if(r->scratch == -1 && palette && needs_scratch(ctx, r)){
+            r->scratch = __builtin_ctz(palette);
+            palette &= ~(1 << r->scratch);
+        } else {
+            break;
+        }
+    }
+    if(spilled && (ctx->explicit_regs & 1)){
+        diag_error(DIAG_VREG_SPILL, ctx->insns[r->first].linenumber, 0, "too many virtual registers live at once in routine starting on line %d, "
+                   "and V0 is used directly so nothing can be spilled", ctx->insns[r->first].linenumber);
+        free(call_clobber); free(live_in); free(live_out);
+        return 9;
+    }
+    if(r->scratch == -1 && needs_scratch(ctx, r)){
+        diag_error(DIAG_VREG_SPILL, ctx->insns[r->first].linenumber, 0, "too many virtual registers live at once in routine starting on line %d, "
+                   "and V1-VE are all used directly so two spilled values can't meet", ctx->insns[r->first].linenumber);
+        free(call_clobber); free(live_in); free(live_out);
+        return 9;
+    }
+    for(int v = 0; v < r->vreg_count; v++){
+        if(r->color[v] == -1 && (no_spill & (1ULL << v))){
+            diag_error(DIAG_VREG_SPILL_I, no_spill_line[v], 0, "too many virtual registers live at once on line %d, and '%s' can't be spilled "
+                       "there since the reload would change I", no_spill_line[v], r->names[v]);
+            free(call_clobber); free(live_in); free(live_out);
+            return 9;
+        }
+    }
+
+    r->spill_base = ctx->spill_slots;
+    ctx->spill_slots += spilled;
+    int slot = r->spill_base;
+    for(int v = 0; v < r->vreg_count; v++){
+        if(r->color[v] == -1){
+            r->color[v] = -2 - slot; // remember the slot
+            slot++;
+        } else {
+            r->clobber |= 1 << r->color[v];
+        }
+    }
+    if(spilled) r->clobber |= 1;
+    if(r->scratch != -1) r->clobber |= 1 << r->scratch;
+    r->clobber |= 0x8000 | ctx->explicit_regs; // VF, and hand written registers
+
+    if(r->vreg_count > 0){
+        const char* name = ctx->insns[r->first].label ? ctx->insns[r->first].label : "(start)";
+        printf("vregs: routine '%s': %d virtual registers, %d spilled\n", name, r->vreg_count, spilled);
+    }
+
+    free(call_clobber);
+    free(live_in);
+    free(live_out);
+    r->state = 2;
+    return 0;
+}
+
+static uint16_t routine_clobber(struct vreg_ctx* ctx, int index){
+    // registers a routine may change before it returns, allocating it first
+    if(ctx->routines[index].state == 0 && allocate_routine(ctx, index) != 0){
+        ctx->error = 9;
+        return ALL_REGS;
+    }
+    if(ctx->routines[index].state == 1) return ALL_REGS; // recursion, or jumps in a cycle
+    return ctx->routines[index].clobber;
+}
+
+static uint16_t callee_clobber(struct vreg_ctx* ctx, struct insn* in){
+    if(in->op_count != 1) return ALL_REGS;
+    int target = find_label(ctx, 0, ctx->count, in->ops[0]);
+    if(target == -1) return ALL_REGS; // another file or a plain address
+    return routine_clobber(ctx, routine_of(ctx, target));
+}
+
+static void emit(struct source* out, int linenumber, const char* fmt, ...){
+    char line[1024];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    add_source_line(out, line, linenumber);
+}
+
+static int rewrite_routine(struct vreg_ctx* ctx, struct routine* r, struct source* out, int* skip_labels){
+    int pending_end = -1;
+    for(int i = r->first; i < r->last; i++){
+        struct insn* in = &ctx->insns[i];
+        if(in->label) emit(out, in->linenumber, "%s:", in->label);
+        if(in->mnemonic == NULL) continue;
+
+        // the first spilled operand is reloaded into V0, a second one goes
+        // through V0 into the scratch register, so it's loaded first
+        int spill[2] = {-1, -1};
+        for(int k = 0, n = 0; k < in->op_count && n < 2; k++){
+            if(in->vreg[k] != -1 && r->color[in->vreg[k]] < 0 && in->vreg[k] != spill[0])
+                spill[n++] = in->vreg[k];
+        }
+        for(int s = 1; s >= 0; s--){
+            if(spill[s] == -1 || !(in->use & (1ULL << spill[s]))) continue;
+            emit(out, in->linenumber, "LD I, %s%d", VREG_SPILL_LABEL, -2 - r->color[spill[s]]);
+            emit(out, in->linenumber, "LD V0, [I]");
+            if(s == 1) emit(out, in->linenumber, "LD V%X, V0", r->scratch);
+        }
+
+        char line[1024];
+        int len = snprintf(line, sizeof(line), "%s", in->mnemonic);
+        for(int k = 0; k < in->op_count; k++){
+            char reg[3] = "V";
+            const char* op = in->ops[k];
+            if(in->vreg[k] != -1){
+                int color = r->color[in->vreg[k]];
+                if(color < 0) color = in->vreg[k] == spill[1] ? r->scratch : 0;
+                reg[1] = "0123456789ABCDEF"[color];
+                op = reg;
+            }
+            len += snprintf(line + len, sizeof(line) - len, "%s%s", k ? ", " : " ", op);
+        }
+        add_source_line(out, line, in->linenumber);
+
+        // only the first operand is ever written
+        if(spill[0] != -1 && (in->def & (1ULL << spill[0]))){
+            emit(out, in->linenumber, "LD I, %s%d", VREG_SPILL_LABEL, -2 - r->color[spill[0]]);
+            emit(out, in->linenumber, "LD [I], V0");
+        }
+
+        if(pending_end != -1){
+            emit(out, in->linenumber, ".__vskip%d_end:", pending_end);
+            pending_end = -1;
+        }
+
+        // a skip only jumps over one instruction, so when the next one grew
+        // reload/store lines, turn the skip into a pair of jumps
+        int next = next_insn(ctx, i, r->last);
+        if(is_skip(in->mnemonic) && next < r->last && spilled_count(r, &ctx->insns[next]) > 0){
+            int n = (*skip_labels)++;
+            emit(out, in->linenumber, "JP .__vskip%d_do", n);
+            emit(out, in->linenumber, "JP .__vskip%d_end", n);
+            emit(out, in->linenumber, ".__vskip%d_do:", n);
+            pending_end = n;
+        }
+    }
+    if(pending_end != -1)
+        emit(out, ctx->insns[r->last - 1].linenumber, ".__vskip%d_end:", pending_end);
+    return 0;
+}
+
+int allocate_vregs(struct source* src, int* spill_slots){
+    struct vreg_ctx ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.count = src->count;
+    ctx.insns = calloc(src->count + 1, sizeof(struct insn));
+    ctx.routines = calloc(src->count + 1, sizeof(struct routine));
+    if(ctx.insns == NULL || ctx.routines == NULL){
+        printf("Error: out of memory\n");
+        exit(1);
+    }
+
+    // split into routines at every label that doesn't start with '.'
+    for(int i = 0; i < src->count; i++){
+        split_insn(&ctx.insns[i], src->lines[i].text, src->lines[i].linenumber);
+        char* label = ctx.insns[i].label;
+        if(i == 0 || (label && label[0] != '.')){
+            if(ctx.routine_count > 0) ctx.routines[ctx.routine_count - 1].last = i;
+            ctx.routines[ctx.routine_count++].first = i;
+        }
+    }
+    if(ctx.routine_count > 0) ctx.routines[ctx.routine_count - 1].last = src->count;
+
+    int result = 0;
+    for(int r = 0; r < ctx.routine_count; r++)
+        if(scan_routine(&ctx, &ctx.routines[r]) != 0) result = 9;
+    i_liveness(&ctx);
+    for(int r = 0; r < ctx.routine_count && result == 0; r++){
+        if(ctx.routines[r].state == 0)
+            result = allocate_routine(&ctx, r);
+        if(ctx.error) result = ctx.error;
+    }
+
+    struct source out;
+    memset(&out, 0, sizeof(out));
+    int skip_labels = 0;
+    for(int r = 0; r < ctx.routine_count && result == 0; r++)
+        result = rewrite_routine(&ctx, &ctx.routines[r], &out, &skip_labels);
+
+    if(result == 0){
+        free_source(src);
+        *src = out;
+        *spill_slots = ctx.spill_slots;
+    } else {
+        free_source(&out);
+    }
+
+    for(int i = 0; i < ctx.count; i++)
+        free(ctx.insns[i].buffer);
+    free(ctx.insns);
+    free(ctx.routines);
+    return result;
+}
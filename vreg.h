@@ -0,0 +1,8 @@
+#pragma once
+
+#include "asm.h"
+
+#define VREG_MAX 64 // per routine
+#define VREG_SPILL_LABEL ".__spill"
+
+int allocate_vregs(struct source*, int* spill_slots);
@@ -0,0 +1,326 @@
+#include "watch.h"
+#include "parse.h"
+#include "link.h"
+#include "utils.h"
+#include "vreg.h"
+#include "superopt.h"
+#include "diag.h"
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+// Watch mode
+// The last build stays in memory: source lines with their offsets, and the
+// object with its symbols. On every save:
+// Step 1: skip the lines that are the same at the start and at the end (by hash)
+// Step 2: encode what is left in between through parse_for_opcode
+// Step 3: if it takes the same number of bytes and no label moved, write just
+//         those bytes into the .ch8. Otherwise build everything again
+
+struct watch_state {
+    const char* source;
+    char* bin_file;
+    const struct asm_options* options;
+    size_t limit;
+
+    struct source src;
+    uint32_t* hashes;
+    struct object obj; // linked, so obj.code is the image
+    int built;
+};
+
+static double elapsed_us(struct timespec* start){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e6 + (now.tv_nsec - start->tv_nsec) / 1e3;
+}
+
+static uint32_t* hash_lines(const struct source* src){
+    uint32_t* hashes = malloc((src->count + 1) * sizeof(uint32_t));
+    if(hashes == NULL){
+        printf("Error: out of memory\n");
+        exit(1);
+    }
+    for(int i = 0; i < src->count; i++)
+        hashes[i] = hash_string(src->lines[i].text);
+    return hashes;
+}
+
+static int read_file(const char* path, struct source* src){
+    FILE* fp = fopen(path, "r");
+    if(fp == NULL){
+        diag_error(DIAG_CANT_OPEN, 0, 0, "can't open file '%s'", path);
+        return 1;
+    }
+    read_source(fp, src);
+    fclose(fp);
+    return 0;
+}
+
+static void drop_build(struct watch_state* w){
+    free_source(&w->src);
+    free(w->hashes);
+    w->hashes = NULL;
+    obj_free(&w->obj);
+    w->built = 0;
+}
+
+static int full_build(struct watch_state* w, struct source* src){
+    // takes ownership of src
+    drop_build(w);
+    w->src = *src;
+    w->hashes = hash_lines(&w->src);
+
+    int spill_slots = 0;
+    int result = 0;
+    int rewritten = w->options->vregs || w->options->rules;
+    if(rewritten){
+        // lines no longer match the file, assemble a copy
+        struct source copy;
+        memset(&copy, 0, sizeof(copy));
+        for(int i = 0; i < w->src.count; i++)
+            add_source_line(&copy, w->src.lines[i].text, w->src.lines[i].linenumber);
+        if(w->options->vregs)
+            result = allocate_vregs(&copy, &spill_slots);
+        if(result == 0 && w->options->rules)
+            result = apply_rules(&copy, w->options->rules);
+        if(result == 0)
+            result = assemble_source(&copy, &w->obj);
+        free_source(&copy);
+    } else {
+        result = assemble_source(&w->src, &w->obj);
+    }
+    for(int i = 0; i < spill_slots; i++){
+        char name[32];
+        snprintf(name, sizeof(name), VREG_SPILL_LABEL "%d", i);
+        obj_define_symbol(&w->obj, name, w->obj.size);
+        obj_emit_byte(&w->obj, 0);
+    }
+    if(result != 0){
+        link_objects(&w->obj, 1, w->limit, NULL); // undefined labels too
+        return result;
+    }
+
+    FILE* outp = fopen(w->bin_file, "wb");
+    if(outp == NULL){
+        diag_error(DIAG_CANT_OPEN, 0, 0, "can't open file '%s'", w->bin_file);
+        return 1;
+    }
+    result = link_objects(&w->obj, 1, w->limit, outp);
+    fclose(outp);
+    if(result != 0) return 8;
+
+    // incremental patching needs line offsets into the file
+    w->built = !rewritten;
+    return 0;
+}
+
+static uint32_t line_end(const struct watch_state* w, int line){
+    return line + 1 < w->src.count ? w->src.lines[line + 1].offset : w->obj.size;
+}
+
+static int encode_line(struct watch_state* w, const char* text, int linenumber, uint8_t* out){
+    // bytes of one line with labels resolved from the last build,
+    // -1 on a parse error, -2 if the line needs a full build
+    char line[1024];
+    strncpy(line, text, sizeof(line) - 1);
+    line[sizeof(line) - 1] = '\0';
+
+    char* label;
+    char* code = split_label(line, &label);
+    if(label != NULL) return -2;
+    while(isspace((unsigned char)*code)) code++;
+    if(*code == '\0') return 0;
+    if(is_directive(code, "INCSPRITE")) return -2; // its labels and the image may change
+
+    int opcode = parse_for_opcode(code);
+    if(report_parse_error(opcode, linenumber, code - line + parse_error_column + 1, code) != 0) return -1;
+
+    int size = 0;
+    if(opcode & OPCODE_LONG){
+        out[size++] = 0xf0;
+        out[size++] = 0x00;
+    }
+    if(parse_symbol_ref != NULL){
+        int id = obj_find_symbol(&w->obj, parse_symbol_ref);
+        if(id == -1 || w->obj.syms[id].flags == SYM_UNDEFINED) return -2;
+        uint32_t address = PROGRAM_START + w->obj.syms[id].offset;
+        if(opcode & OPCODE_LONG)
+            opcode = address;
+        else if(address > 0xFFF)
+            return -2; // let the linker explain
+        else
+            opcode = (opcode & 0xf000) | address;
+    }
+    out[size++] = (opcode >> 8) & 0xff;
+    out[size++] = opcode & 0xff;
+    return size;
+}
+
+static int patch(struct watch_state* w, struct source* src, uint32_t* hashes){
+    // returns bytes patched, -1 on a parse error, -2 if a full build is needed
+    int old_n = w->src.count, new_n = src->count;
+    int first = 0;
+    while(first < old_n && first < new_n && hashes[first] == w->hashes[first] &&
+          strcmp(src->lines[first].text, w->src.lines[first].text) == 0)
+        first++;
+    int tail = 0;
+    while(tail < old_n - first && tail < new_n - first &&
+          hashes[new_n - 1 - tail] == w->hashes[old_n - 1 - tail] &&
+          strcmp(src->lines[new_n - 1 - tail].text, w->src.lines[old_n - 1 - tail].text) == 0)
+        tail++;
+
+    // removed lines with labels would move symbols
+    for(int i = first; i < old_n - tail; i++){
+        char line[1024], *label;
+        strncpy(line, w->src.lines[i].text, sizeof(line) - 1);
+        line[sizeof(line) - 1] = '\0';
+        char* code = split_label(line, &label);
+        if(label != NULL || is_directive(code, "INCSPRITE")) return -2;
+    }
+
+    uint32_t start = first < old_n ? w->src.lines[first].offset : w->obj.size;
+    uint32_t old_end = old_n - tail > first ? line_end(w, old_n - tail - 1) : start;
+
+    uint8_t* bytes = malloc((new_n - tail - first) * 4 + 4);
+    if(bytes == NULL){
+        printf("Error: out of memory\n");
+        exit(1);
+    }
+    uint32_t size = 0;
+    for(int i = first; i < new_n - tail; i++){
+        src->lines[i].offset = start + size;
+        int n = encode_line(w, src->lines[i].text, src->lines[i].linenumber, bytes + size);
+        if(n < 0){
+            free(bytes);
+            return n;
+        }
+        size += n;
+    }
+    if(size != old_end - start){ // addresses after it would shift
+        free(bytes);
+        return -2;
+    }
+
+    FILE* outp = fopen(w->bin_file, "r+b");
+    if(outp == NULL){
+        free(bytes);
+        return -2;
+    }
+    fseek(outp, start, SEEK_SET);
+    fwrite(bytes, 1, size, outp);
+    fclose(outp);
+    memcpy(w->obj.code + start, bytes, size);
+    free(bytes);
+
+    // unchanged lines keep their offsets
+    for(int i = 0; i < first; i++)
+        src->lines[i].offset = w->src.lines[i].offset;
+    for(int i = 0; i < tail; i++)
+        src->lines[new_n - 1 - i].offset = w->src.lines[old_n - 1 - i].offset;
+
+    free_source(&w->src);
+    free(w->hashes);
+    w->src = *src;
+    w->hashes = hashes;
+    return size;
+}
+
+static void rebuild(struct watch_state* w){
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    struct source src;
+    if(read_file(w->source, &src) != 0) return;
+
+    if(w->built){
+        uint32_t* hashes = hash_lines(&src);
+        int patched = patch(w, &src, hashes);
+        if(patched >= 0){
+            printf("watch: patched %d bytes in %.0f us\n", patched, elapsed_us(&start));
+            fflush(stdout);
+            return;
+        }
+        free(hashes);
+        if(patched == -1){ // error is printed, wait for the next save
+            free_source(&src);
+            fflush(stdout);
+            return;
+        }
+    }
+
+    if(full_build(w, &src) == 0)
+        printf("watch: built %zu bytes in %.0f us\n", w->obj.size, elapsed_us(&start));
+    fflush(stdout);
+}
+
+int watch_file(const char* source, const struct asm_options* options, size_t limit){
+    struct watch_state w;
+    memset(&w, 0, sizeof(w));
+    w.source = source;
+    w.options = options;
+    w.limit = limit;
+    w.bin_file = get_filename_for_binary(source);
+    diag_set_file(source);
+
+    // watch the directory, editors often save by renaming a new file over the old one
+    char* dir = malloc(strlen(source) + 2);
+    if(dir == NULL || w.bin_file == NULL){
+        printf("Error: out of memory\n");
+        exit(1);
+    }
+    strcpy(dir, source);
+    char* slash = strrchr(dir, '/');
+    const char* name = source;
+    if(slash != NULL){
+        slash[1] = '\0';
+        name = source + (slash - dir) + 1;
+    } else {
+        strcpy(dir, ".");
+    }
+
+    int fd = inotify_init();
+    if(fd < 0 || inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0){
+        diag_error(DIAG_CANT_WATCH, 0, 0, "can't watch '%s'", dir);
+        free(dir);
+        free(w.bin_file);
+        return 1;
+    }
+
+    struct source src;
+    if(read_file(source, &src) == 0){
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if(full_build(&w, &src) == 0)
+            printf("watch: built %zu bytes in %.0f us\n", w.obj.size, elapsed_us(&start));
+    }
+    diag_close();
+    printf("watch: waiting for changes of '%s'\n", source);
+    fflush(stdout);
+
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for(;;){
+        ssize_t len = read(fd, events, sizeof(events));
+        if(len <= 0) break;
+
+        int changed = 0;
+        for(char* p = events; p < events + len; ){
+            struct inotify_event* event = (struct inotify_event*)p;
+            if(event->len > 0 && strcmp(event->name, name) == 0) changed = 1;
+            p += sizeof(struct inotify_event) + event->len;
+        }
+        if(changed){
+            rebuild(&w);
+            diag_close();
+        }
+    }
+
+    close(fd);
+    drop_build(&w);
+    free(dir);
+    free(w.bin_file);
+    return 0;
+}
@@ -0,0 +1,6 @@
+#pragma once
+
+#include <stddef.h>
+#include "asm.h"
+
+int watch_file(const char*, const struct asm_options*, size_t limit);